@@ -0,0 +1,711 @@
+/*
+ *  tgaconvert.c - Convert many TGA images in parallel
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Functions demonstrated: TGAReadHeader(), TGAReadImageId(),
+ *			    TGAReadColorMap(), TGAReadScanline(),
+ *			    TGABuildRowIndex(), TGAReadRowsAt(),
+ *			    TGAWriteBegin(), TGAWriteScanline(), TGAWriteEnd()
+ *
+ *  Files and directory trees are converted on a pool of threads, one row
+ *  at a time, so every worker needs a few rows of memory whatever the
+ *  image size. Output goes to a directory, mirroring the input tree.
+ *  Extension areas and postage stamps are not carried over, nor is the
+ *  attribute bit of 16 bit pixels, which reading drops.
+ */
+
+/* getopt, getline, lstat, clock_gettime */
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <tga.h>
+#include "utils.h"
+
+#define MAX_THREADS 64
+
+enum { KEEP = -1, RAW, RLE, OPTIMAL };
+
+typedef struct _Options {
+	int		 depth;		/* 0 keeps the pixel format */
+	int		 encode;	/* KEEP, RAW, RLE or OPTIMAL */
+	int		 swap;		/* swap red and blue */
+	int		 vert;		/* TGA_TOP, TGA_BOTTOM or KEEP */
+	int		 horz;		/* TGA_LEFT, TGA_RIGHT or KEEP */
+	int		 verbose;
+} Options;
+
+typedef struct _Job {
+	char	*in;
+	char	*out;
+} Job;
+
+typedef struct _Batch {
+	const Options	*opt;
+	Job		*jobs;
+	size_t		 n_jobs;
+	size_t		 cap;
+	size_t		 next;
+	pthread_mutex_t	 lock;
+	unsigned long long in_bytes;
+	unsigned long long out_bytes;
+	size_t		 failed;
+} Batch;
+
+/* source pixels of one image and where they go */
+typedef struct _Conv {
+	TGA		*in;
+	TGA		*out;
+	TGAData		 src;
+	tbyte		*in_row;
+	tbyte		*bgra;		/* NULL if rows are copied as they are */
+	tbyte		*out_row;
+	size_t		 in_bytes;	/* per pixel, as read */
+	size_t		 out_bytes;	/* per pixel, as written */
+	size_t		 cmap_bytes;	/* per entry, as read */
+	int		 unpacked;	/* pixels read are 5 bit R, G, B */
+	int		 alpha_bit;	/* attribute bit of 16 bit output */
+} Conv;
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s -o DIR [-d DEPTH] [-c ENC] [-x] [-f ORIGIN] "
+		"[-j THREADS] [-l LIST] [-v] [INPUT...]\n", name);
+	fprintf(stderr, "  -o  output directory, input trees are mirrored in it\n");
+	fprintf(stderr, "  -d  8 (grayscale), 15, 16, 24 or 32 bit pixels\n");
+	fprintf(stderr, "  -c  raw, rle or optimal encoding\n");
+	fprintf(stderr, "  -x  swap red and blue\n");
+	fprintf(stderr, "  -f  first pixel at bl, br, tl or tr\n");
+	fprintf(stderr, "  -j  threads, 0 for one per CPU (default)\n");
+	fprintf(stderr, "  -l  more inputs, one per line, - for stdin\n");
+	fprintf(stderr, "  -v  print every file\n");
+	fprintf(stderr, "Formats, encoding and origin default to the input's.\n");
+}
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static char *join(const char *a, const char *b)
+{
+	size_t la = strlen(a);
+	char *s = (char*) malloc(la + strlen(b) + 2);
+	if (s) {
+		sprintf(s, "%s%s%s", a, la && a[la - 1] == '/' ? "" : "/", b);
+	}
+	return s;
+}
+
+
+static int add_job(Batch *batch, const char *in, const char *out_dir,
+		   const char *rel)
+{
+	if (batch->n_jobs == batch->cap) {
+		size_t cap = batch->cap ? 2 * batch->cap : 256;
+		Job *jobs = (Job*) realloc(batch->jobs, cap * sizeof(Job));
+		if (!jobs) {
+			return 0;
+		}
+		batch->jobs = jobs;
+		batch->cap = cap;
+	}
+	Job *job = &batch->jobs[batch->n_jobs];
+	job->in = strdup(in);
+	job->out = join(out_dir, rel);
+	if (!job->in || !job->out) {
+		free(job->in);
+		free(job->out);
+		return 0;
+	}
+	++batch->n_jobs;
+	return 1;
+}
+
+
+static int is_tga(const char *name)
+{
+	size_t n = strlen(name);
+	return n > 4 && strcasecmp(name + n - 4, ".tga") == 0;
+}
+
+
+/* every .tga below dir, rel is the path of dir below the input */
+static int add_tree(Batch *batch, const char *dir, const char *out_dir,
+		    const char *rel)
+{
+	DIR *d = opendir(dir);
+	if (!d) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return 0;
+	}
+
+	int ok = 1;
+	struct dirent *e;
+	while (ok && (e = readdir(d))) {
+		if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+			continue;
+		}
+		char *path = join(dir, e->d_name);
+		char *sub = *rel ? join(rel, e->d_name) : strdup(e->d_name);
+		struct stat st;
+		if (!path || !sub) {
+			ok = 0;
+		} else if (lstat(path, &st)) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		} else if (S_ISDIR(st.st_mode)) {
+			/* symbolic links to directories are not followed */
+			ok = add_tree(batch, path, out_dir, sub);
+		} else if (is_tga(e->d_name) &&
+			   (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))) {
+			ok = add_job(batch, path, out_dir, sub);
+		}
+		free(path);
+		free(sub);
+	}
+	closedir(d);
+	return ok;
+}
+
+
+static int add_input(Batch *batch, const char *in, const char *out_dir)
+{
+	struct stat st;
+	if (stat(in, &st)) {
+		fprintf(stderr, "%s: %s\n", in, strerror(errno));
+		++batch->failed;
+		return 1;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		return add_tree(batch, in, out_dir, "");
+	}
+	/* relative names keep their directories below out_dir, unless they
+	 * would leave it */
+	const char *rel = in;
+	if (*in == '/' || strstr(in, "..")) {
+		const char *slash = strrchr(in, '/');
+		rel = slash ? slash + 1 : in;
+	}
+	while (rel[0] == '.' && rel[1] == '/') {
+		rel += 2;
+	}
+	return add_job(batch, in, out_dir, rel);
+}
+
+
+static int make_parents(const char *path)
+{
+	char *dir = strdup(path);
+	if (!dir) {
+		return 0;
+	}
+	int ok = 1;
+	for (char *p = dir + 1; ok && (p = strchr(p, '/')); ++p) {
+		*p = '\0';
+		if (mkdir(dir, 0777) && errno != EEXIST) {
+			ok = 0;
+		}
+		*p = '/';
+	}
+	free(dir);
+	return ok;
+}
+
+
+/* 15/16 bit pixels are unpacked to 5 bit R, G, B values */
+static void widen5(const tbyte *src, tbyte *dst)
+{
+	tbyte r = src[0], g = src[1], b = src[2];
+	dst[0] = (tbyte) (b << 3 | b >> 2);
+	dst[1] = (tbyte) (g << 3 | g >> 2);
+	dst[2] = (tbyte) (r << 3 | r >> 2);
+}
+
+
+static void to_bgra(const Conv *c, const tbyte *src, tbyte *dst, size_t n)
+{
+	const TGAHeader *hdr = &c->in->hdr;
+
+	for (size_t i = 0; i < n; ++i, dst += 4) {
+		if (TGA_IMGTYPE_IS_MAPPED(c->in)) {
+			size_t e = (size_t) src[i] - hdr->map_first;
+			if (src[i] < hdr->map_first || e >= hdr->map_len) {
+				memset(dst, 0, 4);
+				continue;
+			}
+			const tbyte *p = c->src.cmap + e * c->cmap_bytes;
+			dst[0] = p[0];
+			dst[1] = p[1];
+			dst[2] = p[2];
+			dst[3] = c->cmap_bytes == 4 ? p[3] : 255;
+		} else if (c->in_bytes == 1) {
+			dst[0] = dst[1] = dst[2] = src[i];
+			dst[3] = 255;
+		} else {
+			const tbyte *p = src + i * c->in_bytes;
+			if (c->unpacked) {
+				widen5(p, dst);
+			} else {
+				dst[0] = p[0];
+				dst[1] = p[1];
+				dst[2] = p[2];
+			}
+			dst[3] = c->in_bytes == 4 ? p[3] : 255;
+		}
+	}
+}
+
+
+static void from_bgra(const Conv *c, const tbyte *src, tbyte *dst, size_t n)
+{
+	const int depth = c->out->hdr.depth;
+
+	for (size_t i = 0; i < n; ++i, src += 4) {
+		if (depth == 8) {
+			/* Rec. 601 luma */
+			dst[i] = (tbyte) ((29 * src[0] + 150 * src[1] + 77 * src[2] +
+				128) >> 8);
+		} else if (depth == 15 || depth == 16) {
+			unsigned v = (src[0] >> 3) | (src[1] >> 3) << 5 |
+				(src[2] >> 3) << 10;
+			if (c->alpha_bit && src[3] >= 128) {
+				v |= 0x8000;
+			}
+			dst[2 * i] = v & 0xff;
+			dst[2 * i + 1] = v >> 8;
+		} else {
+			memcpy(dst + i * c->out_bytes, src, c->out_bytes);
+		}
+	}
+}
+
+
+static void swap_rb(tbyte *row, size_t n, size_t bytes)
+{
+	for (size_t i = 0; i < n; ++i, row += bytes) {
+		tbyte t = row[0];
+		row[0] = row[2];
+		row[2] = t;
+	}
+}
+
+
+static void mirror(tbyte *row, size_t n, size_t bytes)
+{
+	for (size_t i = 0, j = n - 1; i < j; ++i, --j) {
+		for (size_t b = 0; b < bytes; ++b) {
+			tbyte t = row[i * bytes + b];
+			row[i * bytes + b] = row[j * bytes + b];
+			row[j * bytes + b] = t;
+		}
+	}
+}
+
+
+/* Work out the output header and the buffers; NULL or a message. */
+static const char *setup(Conv *c, const Options *opt)
+{
+	TGA *in = c->in;
+	const int depth = in->hdr.depth;
+	const int mapped = TGA_IMGTYPE_IS_MAPPED(in);
+
+	if (!TGA_IMGTYPE_AVAILABLE(in)) {
+		return "no image data";
+	}
+	if ((!TGA_IMGTYPE_IS_TRUEC(in) && depth != 8) ||
+	    (TGA_IMGTYPE_IS_TRUEC(in) && depth != 15 && depth != 16 &&
+	     depth != 24 && depth != 32)) {
+		return TGAStrErrorCode(TGA_UNKNOWN_SUB_FORMAT);
+	}
+	c->cmap_bytes = in->hdr.map_entry == 15 || in->hdr.map_entry == 16 ?
+		3 : in->hdr.map_entry / 8;
+	if (mapped && c->cmap_bytes != 3 && c->cmap_bytes != 4) {
+		return TGAStrErrorCode(TGA_UNKNOWN_SUB_FORMAT);
+	}
+	c->in_bytes = depth == 15 || depth == 16 ? 3 : depth / 8;
+
+	c->unpacked = depth == 15 || depth == 16;
+
+	TGAReadImageId(in, &c->src);
+	if (TGA_SUCCEEDED(in)) {
+		TGAReadColorMap(in, &c->src);
+	}
+	if (!TGA_SUCCEEDED(in)) {
+		return TGAStrError(in);
+	}
+	if (mapped && (in->hdr.map_entry == 15 || in->hdr.map_entry == 16)) {
+		for (size_t i = 0; i < in->hdr.map_len; ++i) {
+			tbyte *p = c->src.cmap + 3 * i;
+			widen5(p, p);
+		}
+	}
+
+	/* rows are copied as read unless the format changes or 15/16 bit
+	 * pixels, unpacked on reading, need packing again */
+	const int keep = opt->depth == 0 || (opt->depth == depth && !mapped);
+	const int copy = keep && depth != 15 && depth != 16;
+
+	TGAHeader *hdr = &c->out->hdr;
+	*hdr = in->hdr;
+	if (!keep) {
+		hdr->depth = opt->depth;
+		hdr->img_t = opt->depth == 8 ? TGA_IMGTYPE_UNCOMP_BW :
+			TGA_IMGTYPE_UNCOMP_TRUEC;
+		hdr->map_t = 0;
+		hdr->map_first = 0;
+		hdr->map_len = 0;
+		hdr->map_entry = 0;
+		if (opt->depth == 32) {
+			hdr->alpha = depth == 32 ? in->hdr.alpha : 8;
+		} else if (opt->depth == 16) {
+			hdr->alpha = depth == 32 || (depth == 16 && in->hdr.alpha) ||
+				(mapped && c->cmap_bytes == 4);
+		} else {
+			hdr->alpha = 0;
+		}
+	} else if (mapped) {
+		/* 15/16 bit entries were unpacked on reading */
+		hdr->map_entry = c->cmap_bytes * 8;
+		if (opt->swap && c->cmap_bytes >= 3) {
+			swap_rb(c->src.cmap, hdr->map_len, c->cmap_bytes);
+		}
+	}
+	c->alpha_bit = hdr->depth == 16 && hdr->alpha;
+	if (opt->vert != KEEP) {
+		hdr->vert = opt->vert;
+	}
+	if (opt->horz != KEEP) {
+		hdr->horz = opt->horz;
+	}
+
+	const size_t width = in->hdr.width;
+	c->out_bytes = (hdr->depth + 7) / 8;
+	c->in_row = (tbyte*) malloc(width * c->in_bytes + 1);
+	if (!copy) {
+		c->bgra = (tbyte*) malloc(width * 4 + 1);
+		c->out_row = (tbyte*) malloc(width * c->out_bytes + 1);
+	}
+	if (!c->in_row || (!copy && (!c->bgra || !c->out_row))) {
+		return TGAStrErrorCode(TGA_OOM);
+	}
+	if (copy) {
+		c->out_row = c->in_row;
+	}
+	return NULL;
+}
+
+
+/* Converts job->in into tmp; NULL or a message. */
+static const char *convert(Conv *c, const Options *opt, const char *in_name,
+			   const char *tmp)
+{
+	c->in = TGAOpen(in_name, "rb");
+	if (!c->in) {
+		return TGAStrErrorCode(TGA_OPEN_FAIL);
+	}
+	if (TGAReadHeader(c->in) != TGA_OK) {
+		return TGAStrError(c->in);
+	}
+	c->out = TGAOpen(tmp, "wb");
+	if (!c->out) {
+		return TGAStrErrorCode(TGA_OPEN_FAIL);
+	}
+	const char *msg = setup(c, opt);
+	if (msg) {
+		return msg;
+	}
+
+	TGA *in = c->in;
+	TGA *out = c->out;
+	const int flip_v = out->hdr.vert != in->hdr.vert;
+	const int flip_h = out->hdr.horz != in->hdr.horz;
+	if (flip_v && TGABuildRowIndex(in) != TGA_OK) {
+		return TGAStrError(in);
+	}
+
+	int encode = opt->encode;
+	if (encode == KEEP) {
+		encode = TGA_IMGTYPE_IS_ENCODED(in) ? RLE : RAW;
+	}
+	TGAData data;
+	memset(&data, 0, sizeof(data));
+	data.flags = TGA_IMAGE_ID | TGA_IMAGE_DATA;
+	data.img_id = c->src.img_id;
+	data.cmap = c->src.cmap;
+	if (encode != RAW) {
+		data.flags |= TGA_RLE_ENCODE;
+	}
+	const tuint32 write_flags = encode == OPTIMAL ? TGA_RLE_OPTIMAL : 0;
+	if (TGAWriteBegin(out, &data) != TGA_OK) {
+		return TGAStrError(out);
+	}
+
+	const size_t width = in->hdr.width;
+	const int swap_pixels = opt->swap && !TGA_IMGTYPE_IS_MAPPED(out) &&
+		c->out_bytes >= 3;
+	for (tuint32 y = 0; y < in->hdr.height; ++y) {
+		if (flip_v) {
+			int err = TGAReadRowsAt(in, c->in_row,
+				in->hdr.height - 1 - y, 1, 0);
+			if (err != TGA_OK) {
+				return TGAStrErrorCode(err);
+			}
+		} else if (TGAReadScanline(in, c->in_row, 0) != TGA_OK) {
+			return TGAStrError(in);
+		}
+
+		if (c->bgra) {
+			to_bgra(c, c->in_row, c->bgra, width);
+			if (opt->swap) {
+				swap_rb(c->bgra, width, 4);
+			}
+			from_bgra(c, c->bgra, c->out_row, width);
+		} else if (swap_pixels) {
+			swap_rb(c->out_row, width, c->out_bytes);
+		}
+		if (flip_h) {
+			mirror(c->out_row, width, c->out_bytes);
+		}
+
+		if (TGAWriteScanline(out, c->out_row, write_flags) != TGA_OK) {
+			return TGAStrError(out);
+		}
+	}
+	if (TGAWriteEnd(out) != TGA_OK) {
+		return TGAStrError(out);
+	}
+	return NULL;
+}
+
+
+static void run_job(Batch *batch, const Job *job)
+{
+	char *tmp = (char*) malloc(strlen(job->out) + 5);
+	Conv c;
+	memset(&c, 0, sizeof(c));
+	unsigned long long in_bytes = 0, out_bytes = 0;
+
+	const char *msg = NULL;
+	if (!tmp) {
+		msg = TGAStrErrorCode(TGA_OOM);
+	} else if (!make_parents(job->out)) {
+		msg = strerror(errno);
+	} else {
+		sprintf(tmp, "%s.tmp", job->out);
+		msg = convert(&c, batch->opt, job->in, tmp);
+	}
+	if (c.in) {
+		in_bytes = c.in->size;
+	}
+	if (c.out) {
+		out_bytes = c.out->off;
+	}
+
+	if (c.bgra) {
+		free(c.out_row);
+	}
+	free(c.bgra);
+	free(c.in_row);
+	TGAFreeTGAData(&c.src);
+	TGAClose(c.in);
+	TGAClose(c.out);
+	if (tmp && !msg && rename(tmp, job->out)) {
+		msg = strerror(errno);
+	}
+	if (tmp && msg) {
+		remove(tmp);
+	}
+	free(tmp);
+
+	pthread_mutex_lock(&batch->lock);
+	if (msg) {
+		fprintf(stderr, "%s: %s\n", job->in, msg);
+		++batch->failed;
+	} else {
+		if (batch->opt->verbose) {
+			printf("%s -> %s: %llu -> %llu bytes\n", job->in, job->out,
+				in_bytes, out_bytes);
+		}
+		batch->in_bytes += in_bytes;
+		batch->out_bytes += out_bytes;
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+
+static void *worker(void *arg)
+{
+	Batch *batch = (Batch*) arg;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		size_t i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (i >= batch->n_jobs) {
+			break;
+		}
+		run_job(batch, &batch->jobs[i]);
+	}
+	return NULL;
+}
+
+
+static int add_list(Batch *batch, const char *list, const char *out_dir)
+{
+	FILE *f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", list, strerror(errno));
+		return 0;
+	}
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+	int ok = 1;
+	while (ok && (n = getline(&line, &cap, f)) > 0) {
+		if (line[n - 1] == '\n') {
+			line[--n] = '\0';
+		}
+		if (n > 0) {
+			ok = add_input(batch, line, out_dir);
+		}
+	}
+	free(line);
+	if (f != stdin) {
+		fclose(f);
+	}
+	return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+	Options opt = { 0, KEEP, 0, KEEP, KEEP, 0 };
+	const char *out_dir = NULL;
+	const char *list = NULL;
+	long threads = 0;
+
+	int o;
+	while ((o = getopt(argc, argv, "o:d:c:xf:j:l:v")) != -1) {
+		switch (o) {
+		case 'o':
+			out_dir = optarg;
+			break;
+		case 'd':
+			opt.depth = atoi(optarg);
+			if (opt.depth != 8 && opt.depth != 15 && opt.depth != 16 &&
+			    opt.depth != 24 && opt.depth != 32) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'c':
+			if (!strcmp(optarg, "raw")) {
+				opt.encode = RAW;
+			} else if (!strcmp(optarg, "rle")) {
+				opt.encode = RLE;
+			} else if (!strcmp(optarg, "optimal")) {
+				opt.encode = OPTIMAL;
+			} else {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'x':
+			opt.swap = 1;
+			break;
+		case 'f':
+			if (strlen(optarg) != 2 || !strchr("bt", optarg[0]) ||
+			    !strchr("lr", optarg[1])) {
+				usage(argv[0]);
+				return 2;
+			}
+			opt.vert = optarg[0] == 't' ? TGA_TOP : TGA_BOTTOM;
+			opt.horz = optarg[1] == 'r' ? TGA_RIGHT : TGA_LEFT;
+			break;
+		case 'j':
+			threads = atol(optarg);
+			break;
+		case 'l':
+			list = optarg;
+			break;
+		case 'v':
+			opt.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (!out_dir || (optind == argc && !list)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	Batch batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.opt = &opt;
+	int ok = 1;
+	for (int i = optind; ok && i < argc; ++i) {
+		ok = add_input(&batch, argv[i], out_dir);
+	}
+	if (ok && list) {
+		ok = add_list(&batch, list, out_dir);
+	}
+	if (!ok || pthread_mutex_init(&batch.lock, NULL)) {
+		TGA_EXAMPLE_ERROR(TGAStrErrorCode(TGA_ERROR));
+		return 2;
+	}
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads < 1) threads = 1;
+	if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+	const double start = now();
+	pthread_t tid[MAX_THREADS];
+	int started[MAX_THREADS];
+	for (long t = 1; t < threads; ++t) {
+		started[t] = !pthread_create(&tid[t], NULL, worker, &batch);
+	}
+	worker(&batch);
+	for (long t = 1; t < threads; ++t) {
+		if (started[t]) {
+			pthread_join(tid[t], NULL);
+		}
+	}
+	const double secs = now() - start;
+	pthread_mutex_destroy(&batch.lock);
+
+	const double mb_in = batch.in_bytes / 1e6;
+	const double mb_out = batch.out_bytes / 1e6;
+	printf("%zu files, %zu failed, %.1f MB -> %.1f MB in %.2f s: "
+		"%.1f MB/s, %.1f files/s, %ld threads\n", batch.n_jobs,
+		batch.failed, mb_in, mb_out, secs,
+		secs > 0 ? mb_in / secs : 0.0,
+		secs > 0 ? batch.n_jobs / secs : 0.0, threads);
+
+	for (size_t i = 0; i < batch.n_jobs; ++i) {
+		free(batch.jobs[i].in);
+		free(batch.jobs[i].out);
+	}
+	free(batch.jobs);
+	return batch.failed ? 1 : 0;
+}
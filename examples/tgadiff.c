@@ -0,0 +1,175 @@
+/*
+ *  tgadiff.c - Compare two TGA images
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Functions demonstrated: TGAOpen(), TGAReadHeader(), TGADiffImages(),
+ *			    TGAWriteImage(), TGAClose()
+ *
+ *  Exits with 0 if the images are equal within the tolerance, 1 if they
+ *  differ and 2 on errors.
+ */
+
+/* getopt */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tga.h>
+#include "utils.h"
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t TOL[,TOL...]] [-r X,Y,W,H] [-j THREADS] "
+		"[-f] [-m MASK] IMAGE1 IMAGE2\n", name);
+	fprintf(stderr, "  -t  tolerance, one value or one per channel "
+		"in file order (B,G,R,A)\n");
+	fprintf(stderr, "  -r  compare this region only\n");
+	fprintf(stderr, "  -j  threads, 0 for one per CPU (default)\n");
+	fprintf(stderr, "  -f  stop at the first mismatch\n");
+	fprintf(stderr, "  -m  write a grayscale TGA, white where pixels differ\n");
+}
+
+
+static int write_mask(const char *name, TGA *ref, TGADiff *diff)
+{
+	TGA *out = TGAOpen(name, "wb");
+	if (!out) {
+		TGA_EXAMPLE_ERROR(TGAStrErrorCode(TGA_OPEN_FAIL));
+		return 0;
+	}
+
+	memset(&out->hdr, 0, sizeof(out->hdr));
+	out->hdr.img_t = TGA_IMGTYPE_UNCOMP_BW;
+	out->hdr.width = diff->w;
+	out->hdr.height = diff->h;
+	out->hdr.depth = 8;
+	out->hdr.vert = ref->hdr.vert;
+	out->hdr.horz = ref->hdr.horz;
+
+	TGAData data;
+	memset(&data, 0, sizeof(data));
+	data.flags = TGA_IMAGE_DATA | TGA_RLE_ENCODE;
+	data.img_data = diff->mask;
+
+	TGAWriteImage(out, &data);
+	int ok = TGA_SUCCEEDED(out);
+	if (!ok) {
+		TGA_EXAMPLE_ERROR(TGAStrError(out));
+	}
+	TGAClose(out);
+	return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+	TGADiff diff;
+	memset(&diff, 0, sizeof(diff));
+	const char *mask = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:r:j:fm:")) != -1) {
+		unsigned v[4];
+		int n;
+		switch (opt) {
+		case 't':
+			n = sscanf(optarg, "%u,%u,%u,%u", &v[0], &v[1], &v[2], &v[3]);
+			if (n < 1) {
+				usage(argv[0]);
+				return 2;
+			}
+			for (int c = 0; c < 4; ++c) {
+				unsigned t = v[c < n ? c : 0];
+				diff.tolerance[c] = t > 255 ? 255 : t;
+			}
+			break;
+		case 'r':
+			if (sscanf(optarg, "%u,%u,%u,%u", &v[0], &v[1], &v[2],
+				   &v[3]) != 4) {
+				usage(argv[0]);
+				return 2;
+			}
+			diff.x = v[0];
+			diff.y = v[1];
+			diff.w = v[2];
+			diff.h = v[3];
+			break;
+		case 'j':
+			diff.threads = atoi(optarg);
+			break;
+		case 'f':
+			diff.first_only = 1;
+			break;
+		case 'm':
+			mask = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	TGA *img[2];
+	for (int i = 0; i < 2; ++i) {
+		img[i] = TGAOpen(argv[optind + i], "rb");
+		if (!img[i]) {
+			TGA_EXAMPLE_ERROR(TGAStrErrorCode(TGA_OPEN_FAIL));
+			return 2;
+		}
+		if (TGAReadHeader(img[i]) != TGA_OK) {
+			TGA_EXAMPLE_ERROR(TGAStrError(img[i]));
+			return 2;
+		}
+	}
+
+	const int whole = diff.w == 0 || diff.h == 0;
+	const size_t w = whole ? img[0]->hdr.width : diff.w;
+	const size_t h = whole ? img[0]->hdr.height : diff.h;
+	if (mask) {
+		diff.mask = (tbyte*) malloc(w * h != 0 ? w * h : 1);
+		if (!diff.mask) {
+			TGA_EXAMPLE_ERROR(TGAStrErrorCode(TGA_OOM));
+			return 2;
+		}
+	}
+
+	int err = TGADiffImages(img[0], img[1], &diff);
+	if (err != TGA_OK) {
+		TGA_EXAMPLE_ERROR(TGAStrErrorCode(err));
+		return 2;
+	}
+
+	printf("mismatches=%llu\n", (unsigned long long) diff.mismatches);
+	if (diff.mismatches) {
+		printf("first=%u,%u\n", diff.first_x, diff.first_y);
+	}
+	printf("max_error=%u,%u,%u,%u\n", diff.max_error[0], diff.max_error[1],
+		diff.max_error[2], diff.max_error[3]);
+	if (diff.max_error[0] | diff.max_error[1] | diff.max_error[2] |
+	    diff.max_error[3]) {
+		printf("psnr=%.2f\n", diff.psnr);
+	} else {
+		printf("psnr=inf\n");
+	}
+
+	int result = diff.mismatches ? 1 : 0;
+	if (mask && !write_mask(mask, img[0], &diff)) {
+		result = 2;
+	}
+
+	free(diff.mask);
+	TGAClose(img[0]);
+	TGAClose(img[1]);
+	return result;
+}
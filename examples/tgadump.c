@@ -7,11 +7,12 @@
  *  the Free Software Foundation; either version 2 of the License, or
  *  (at your option) any later version.
  *
- *  Functions demonstrated: TGAOpen(), TGAReadImage(), TGAClose()
+ *  Functions demonstrated: TGAOpen(), TGAOpenFd(), TGAReadImage(), TGAClose()
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <tga.h>
 #include "utils.h"
@@ -31,8 +32,9 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* "-" reads from stdin, which may be a pipe */
 	printf("[open] name=%s, mode=%s\n", argv[1], "r");
-	TGA *tga = TGAOpen(argv[1], "r");
+	TGA *tga = strcmp(argv[1], "-") ? TGAOpen(argv[1], "r") : TGAOpenFd(stdin);
 	if (!TGA_SUCCEEDED(tga)) {
 		TGA_EXAMPLE_ERROR(TGAStrError(tga));
 		return 1;
@@ -0,0 +1,322 @@
+/*
+ *  tgaopt.c - Recompress TGA images with size-optimal RLE
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Functions demonstrated: TGAOpen(), TGAReadImage(), TGAReadPostageStamp(),
+ *			    TGAWriteImage(), TGADiffImages(), TGAClose()
+ *
+ *  Every file is rewritten with TGA_RLE_OPTIMAL, or raw if that is
+ *  smaller, and replaced only if the result is smaller and decodes to the
+ *  same pixels. Files are processed on several threads. TGA 2.0 files
+ *  whose extension area holds more than the postage stamp libtga writes
+ *  are left alone, since it would be lost.
+ */
+
+/* getopt, sysconf, fseeko */
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tga.h>
+#include "utils.h"
+
+#define MAX_THREADS 64
+
+/* TGA 2.0 footer and extension area */
+#define FOOTER_SIZE	26
+#define EXT_SIZE	495
+#define EXT_STAMP_OFF	486
+#define EXT_SCAN_OFF	490
+#define EXT_ATTR_OFF	494
+
+typedef struct _Work {
+	char		**files;
+	int		  n_files;
+	int		  next;
+	int		  dry_run;
+	pthread_mutex_t	  lock;
+	unsigned long long before;
+	unsigned long long after;
+	int		  failed;
+} Work;
+
+
+static long long file_size(const char *name)
+{
+	struct stat st;
+	return stat(name, &st) ? -1 : (long long) st.st_size;
+}
+
+
+static int write_image(const char *name, TGAHeader *hdr, TGAData *data,
+		       tuint32 flags)
+{
+	TGA *out = TGAOpen(name, "wb");
+	if (!out) {
+		return TGA_OPEN_FAIL;
+	}
+	out->hdr = *hdr;
+	data->flags = flags;
+	int err = TGAWriteImage(out, data);
+	TGAClose(out);
+	return err;
+}
+
+
+static unsigned long le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | ((unsigned long) p[2] << 16) |
+		((unsigned long) p[3] << 24);
+}
+
+
+/* Whether name has a developer area, or an extension area with anything
+ * but the postage stamp and attribute type TGAWriteImage fills in:
+ * author, comments, timestamps, gamma and the like. */
+static int foreign_extension(const char *name, const TGAHeader *hdr)
+{
+	unsigned char footer[FOOTER_SIZE];
+	unsigned char ext[EXT_SIZE];
+	FILE *f = fopen(name, "rb");
+	if (!f) {
+		return 1;
+	}
+
+	int foreign = 0;
+	if (fseeko(f, -FOOTER_SIZE, SEEK_END) == 0 &&
+	    fread(footer, FOOTER_SIZE, 1, f) == 1 &&
+	    !memcmp(footer + 8, "TRUEVISION-XFILE.", 18)) {
+		const unsigned long ext_off = le32(footer);
+		foreign = le32(footer + 4) != 0;
+		if (!foreign && ext_off) {
+			foreign = fseeko(f, (off_t) ext_off, SEEK_SET) ||
+				fread(ext, EXT_SIZE, 1, f) != 1 ||
+				ext[0] != (EXT_SIZE & 0xff) || ext[1] != (EXT_SIZE >> 8) ||
+				le32(ext + EXT_SCAN_OFF) != 0 ||
+				ext[EXT_ATTR_OFF] != (hdr->alpha ? 3 : 0);
+			for (int i = 2; !foreign && i < EXT_STAMP_OFF; ++i) {
+				foreign = ext[i] != 0;
+			}
+		}
+	}
+	fclose(f);
+	return foreign;
+}
+
+
+/* whether name and tmp hold the same pixels */
+static int same_pixels(const char *name, const char *tmp)
+{
+	TGA *a = TGAOpen(name, "rb");
+	TGA *b = TGAOpen(tmp, "rb");
+	TGADiff diff;
+	memset(&diff, 0, sizeof(diff));
+	diff.threads = 1;
+	int same = a && b && TGAReadHeader(a) == TGA_OK &&
+		TGAReadHeader(b) == TGA_OK &&
+		TGADiffImages(a, b, &diff) == TGA_OK && diff.mismatches == 0;
+	TGAClose(a);
+	TGAClose(b);
+	return same;
+}
+
+
+/* Returns a message for the file, NULL if it was shrunk. */
+static const char *optimize(const char *name, int dry_run, long long *before,
+			    long long *after, int *failed)
+{
+	*before = *after = file_size(name);
+	*failed = 1;
+
+	TGA *in = TGAOpen(name, "rb");
+	if (!in || TGAReadHeader(in) != TGA_OK) {
+		TGAClose(in);
+		return "cannot read";
+	}
+	/* 15/16 bit pixels and colors are widened on reading */
+	if (!TGA_IMGTYPE_AVAILABLE(in) || in->hdr.depth == 15 ||
+	    in->hdr.depth == 16 || (TGA_IS_MAPPED(in) &&
+	    (in->hdr.map_entry == 15 || in->hdr.map_entry == 16))) {
+		TGAClose(in);
+		*failed = 0;
+		return "skipped, format kept as is";
+	}
+	if (foreign_extension(name, &in->hdr)) {
+		TGAClose(in);
+		*failed = 0;
+		return "skipped, extension area kept as is";
+	}
+
+	TGAStamp stamp;
+	tuint32 flags = TGA_IMAGE_ID | TGA_IMAGE_DATA;
+	if (TGAReadPostageStamp(in, &stamp, 0) == TGA_OK && stamp.data) {
+		flags |= TGA_POSTAGE_STAMP;
+	}
+	TGAFreePostageStamp(&stamp);
+
+	TGAData data;
+	memset(&data, 0, sizeof(data));
+	data.flags = TGA_IMAGE_ID | TGA_IMAGE_DATA;
+	if (TGAReadImage(in, &data) != TGA_OK) {
+		TGAFreeTGAData(&data);
+		TGAClose(in);
+		return "cannot read";
+	}
+	TGAHeader hdr = in->hdr;
+	TGAClose(in);
+
+	char *rle = (char*) malloc(2 * strlen(name) + 10);
+	if (!rle) {
+		TGAFreeTGAData(&data);
+		return "out of memory";
+	}
+	char *raw = rle + strlen(name) + 5;
+	sprintf(rle, "%s.rle", name);
+	sprintf(raw, "%s.raw", name);
+
+	long long rle_size = -1, raw_size = -1;
+	if (write_image(rle, &hdr, &data, flags | TGA_RLE_ENCODE |
+			TGA_RLE_OPTIMAL) == TGA_OK) {
+		rle_size = file_size(rle);
+	}
+	/* the raw file has the same header and trailer, so it can only be
+	 * smaller if the RLE data is larger than the raw pixels */
+	const long long prefix = 18 + hdr.id_len +
+		(hdr.map_t ? (long long) hdr.map_len * ((hdr.map_entry + 7) / 8) : 0);
+	const long long pixels = (long long) hdr.width * hdr.height *
+		((hdr.depth + 7) / 8);
+	if (rle_size < 0 || rle_size - prefix > pixels) {
+		if (write_image(raw, &hdr, &data, flags) == TGA_OK) {
+			raw_size = file_size(raw);
+		}
+	}
+	TGAFreeTGAData(&data);
+
+	const char *best = rle;
+	long long size = rle_size;
+	if (raw_size >= 0 && (size < 0 || raw_size < size)) {
+		best = raw;
+		size = raw_size;
+	}
+
+	const char *msg;
+	if (size < 0) {
+		msg = "cannot write";
+	} else if (size >= *before) {
+		msg = "already optimal";
+		*failed = 0;
+	} else if (!same_pixels(name, best)) {
+		msg = "pixels differ after rewriting, kept";
+	} else if (!dry_run && rename(best, name)) {
+		msg = "cannot replace";
+	} else {
+		*after = size;
+		msg = NULL;
+		*failed = 0;
+	}
+	remove(rle);
+	remove(raw);
+	free(rle);
+	return msg;
+}
+
+
+static void *worker(void *arg)
+{
+	Work *work = (Work*) arg;
+
+	for (;;) {
+		pthread_mutex_lock(&work->lock);
+		int i = work->next++;
+		pthread_mutex_unlock(&work->lock);
+		if (i >= work->n_files) {
+			break;
+		}
+
+		const char *name = work->files[i];
+		long long before, after;
+		int failed;
+		const char *msg = optimize(name, work->dry_run, &before, &after,
+					   &failed);
+
+		pthread_mutex_lock(&work->lock);
+		if (msg) {
+			printf("%s: %s\n", name, msg);
+		} else {
+			printf("%s: %lld -> %lld bytes\n", name, before, after);
+		}
+		if (before >= 0) {
+			work->before += before;
+			work->after += after;
+		}
+		work->failed |= failed;
+		pthread_mutex_unlock(&work->lock);
+	}
+	return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+	Work work;
+	memset(&work, 0, sizeof(work));
+	long threads = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "j:n")) != -1) {
+		switch (opt) {
+		case 'j':
+			threads = atol(optarg);
+			break;
+		case 'n':
+			work.dry_run = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-j THREADS] [-n] FILE...\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "Usage: %s [-j THREADS] [-n] FILE...\n", argv[0]);
+		return 1;
+	}
+
+	work.files = argv + optind;
+	work.n_files = argc - optind;
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads < 1) threads = 1;
+	if (threads > MAX_THREADS) threads = MAX_THREADS;
+	if (threads > work.n_files) threads = work.n_files;
+
+	if (pthread_mutex_init(&work.lock, NULL)) {
+		TGA_EXAMPLE_ERROR(TGAStrErrorCode(TGA_ERROR));
+		return 1;
+	}
+	pthread_t tid[MAX_THREADS];
+	int started[MAX_THREADS];
+	for (long t = 1; t < threads; ++t) {
+		started[t] = !pthread_create(&tid[t], NULL, worker, &work);
+	}
+	worker(&work);
+	for (long t = 1; t < threads; ++t) {
+		if (started[t]) {
+			pthread_join(tid[t], NULL);
+		}
+	}
+	pthread_mutex_destroy(&work.lock);
+
+	printf("total: %llu -> %llu bytes%s\n", work.before, work.after,
+		work.dry_run ? " (dry run)" : "");
+	return work.failed;
+}
@@ -36,11 +36,55 @@ extern "C" {
 #define TGA_COLOR_MAP	0x08
 /* RLE */
 #define TGA_RLE_ENCODE  0x10
+/* let TGAWriteImage pick raw or RLE from TGAEstimateRLE */
+#define TGA_AUTO_ENCODE 0x200
+
+/* TGA 2.0 postage stamp, generated by TGAWriteImage */
+#define TGA_POSTAGE_STAMP 0x80
+
+/* reuse the buffers of a TGAData, see TGAPoolAcquireData */
+#define TGA_KEEP_BUFFERS 0x100
+
+/* fill data->stats while decoding the image, honoured by TGAReadImage,
+ * TGAReadScanlines and the push decoder only: the single scanline,
+ * strided, planar and positional readers ignore it, and the scaled
+ * readers with scale > 1 leave data->stats untouched */
+#define TGA_STATS	0x400
+
+/* TGAWriteImage: build the whole file in memory and submit it with a
+ * single writev, optionally reserving its final size first */
+#define TGA_WRITEV	0x800
+#define TGA_PREALLOCATE	0x1000
+
+/* with TGA_RLE_ENCODE: pick the packets of every scanline for the fewest
+ * bytes instead of greedily, slower to write */
+#define TGA_RLE_OPTIMAL	0x2000
+
+/* side outputs of TGA_STATS, in TGAStats.want */
+#define TGA_STATS_XXH64		0x01
+#define TGA_STATS_CRC32		0x02
+#define TGA_STATS_HISTOGRAM	0x04
+#define TGA_STATS_MINMAX	0x08
+#define TGA_STATS_ALPHA		0x10
 
 /* color format */
 #define TGA_RGB		0x20
 #define TGA_BGR		0x40
 
+/* stages of a TGATraceEvent */
+#define TGA_TRACE_OPEN		0
+#define TGA_TRACE_HEADER	1
+#define TGA_TRACE_IMAGE_ID	2
+#define TGA_TRACE_COLOR_MAP	3
+#define TGA_TRACE_ROWS		4
+#define TGA_TRACE_CONVERT	5
+#define TGA_TRACE_CLOSE		6
+
+/* element types of TGAReadPlanar */
+#define TGA_PLANAR_U8	0
+#define TGA_PLANAR_F32	1
+#define TGA_PLANAR_F16	2
+
 /* orientation */
 #define TGA_BOTTOM	0x0
 #define TGA_TOP		0x1
@@ -66,6 +110,8 @@ extern "C" {
 #define TGA_IMGTYPE_IS_BW(tga)          ((((tga)->hdr.img_t) & 0x3) == 0x3)
 #define TGA_IMGTYPE_IS_ENCODED(tga)     ((((tga)->hdr.img_t) & 0x8) == 0x8)
 
+#define TGA_SCALED_DIM(dim, scale)      (((dim) + (scale) - 1) / (scale))
+
 #define TGA_HAS_ID(tga)         ((tga)->hdr.id_len != 0)
 #define TGA_IS_MAPPED(tga)      ((tga)->hdr.map_t == 1)
 
@@ -79,9 +125,12 @@ enum {
 	TGA_READ_FAIL,
 	TGA_WRITE_FAIL,
 	TGA_UNKNOWN_SUB_FORMAT, /* invalid bit depth */
+	TGA_TOO_LARGE,		/* image exceeds the memory limit */
+	TGA_TRUNCATED,		/* file too short for the image */
 	TGA_ERRORS_NB
 };
 
+typedef uint64_t	tuint64;
 typedef uint32_t	tuint32;
 typedef uint16_t	tuint16;
 typedef uint8_t	tuint8;
@@ -93,8 +142,24 @@ typedef tuint32	tlong;
 typedef struct _TGAHeader TGAHeader;
 typedef struct _TGAData	  TGAData;
 typedef struct _TGA	  TGA;
+typedef struct _TGADecoder TGADecoder;
+typedef struct _TGAStamp  TGAStamp;
+typedef struct _TGAPool	  TGAPool;
+typedef struct _TGACache  TGACache;
+typedef struct _TGACached TGACached;
+typedef struct _TGALazy	  TGALazy;
+typedef struct _TGAPack	  TGAPack;
+typedef struct _TGAPackWriter TGAPackWriter;
+typedef struct _TGAEstimate TGAEstimate;
+typedef struct _TGAStats  TGAStats;
+typedef struct _TGAPlanar TGAPlanar;
+typedef struct _TGATraceEvent TGATraceEvent;
+typedef struct _TGADiff	  TGADiff;
 
 typedef void (*TGAErrorProc)(TGA*, int);
+typedef void (*TGAScanlineProc)(TGADecoder*, tshort row, const tbyte *line,
+				void *user);
+typedef void (*TGATraceProc)(const TGATraceEvent *event, void *user);
 
 
 /* TGA image header */
@@ -121,15 +186,113 @@ struct _TGAData {
 	tbyte	*cmap;		/* F7: color map */
 	tbyte	*img_data;	/* F8: image data */
 	tuint32	 flags;
+	size_t	 img_id_size;	/* allocated sizes of the buffers above */
+	size_t	 cmap_size;
+	size_t	 img_data_size;
+	TGAStats *stats;	/* only used with TGA_STATS */
+};
+
+/* Pixel statistics computed during decode, over the decoded bytes of
+ * img_data. Images without alpha channel count as opaque. */
+struct _TGAStats {
+	tuint32	want;		/* TGA_STATS_* to compute */
+	tuint8	channels;	/* bytes per decoded pixel */
+	tuint64	xxh64;		/* xxHash64, seed 0 */
+	tuint32	crc32;		/* CRC-32 (ISO-HDLC, as zlib) */
+	tuint64	hist[4][256];	/* per channel, in decoded byte order */
+	tbyte	min[4];
+	tbyte	max[4];
+	int	alpha_opaque;	/* every alpha is 255 */
+	int	alpha_binary;	/* every alpha is 0 or 255 */
+};
+
+/* decoded image shared through a TGACache, read-only */
+struct _TGACached {
+	TGAHeader	hdr;		/* as left by TGAReadImage */
+	TGAData		data;
+};
+
+/* TGA 2.0 postage stamp */
+struct _TGAStamp {
+	tbyte	 width;
+	tbyte	 height;
+	tbyte	 depth;		/* bit-depth of data, 24 for 15/16 bit images */
+	tbyte	*data;
+};
+
+/* predicted encoding of an image, see TGAEstimateRLE */
+struct _TGAEstimate {
+	tuint64	raw_size;	/* uncompressed image data */
+	tuint64	rle_size;	/* predicted RLE encoded image data */
+	int	opaque;		/* 32 bit image, every scanned alpha is 255 */
+};
+
+/* planar output of TGAReadPlanar. Float planes hold
+ * (v / max - mean) / std, with max 255 (31 for 15/16 bit images) and v
+ * optionally sRGB-decoded first; alpha is never sRGB-decoded. */
+struct _TGAPlanar {
+	int	type;		/* TGA_PLANAR_* */
+	tuint8	planes;		/* number of output planes, 1 to 4 */
+	tuint8	channel[4];	/* decoded channel of each plane, alpha is 3 */
+	int	srgb;		/* convert sRGB color to linear */
+	float	mean[4];	/* per plane, F32/F16 only */
+	float	std[4];		/* per plane, 0 is taken as 1 */
+};
+
+/* comparison of two images by TGADiffImages. Channels are those
+ * decoded without TGA_RGB, color maps expanded. */
+struct _TGADiff {
+	tuint32	x;		/* region, whole image if w or h is 0 */
+	tuint32	y;
+	tuint32	w;
+	tuint32	h;
+	tbyte	tolerance[4];	/* largest error per channel still equal */
+	int	first_only;	/* stop soon after the first mismatch */
+	tuint32	threads;	/* 0 for one per online CPU */
+	tbyte	*mask;		/* optional, w * h, 255 where pixels differ,
+				   0 in rows first_only did not compare */
+	tuint64	mismatches;	/* pixels with a channel out of tolerance */
+	tuint32	first_x;	/* topmost, leftmost mismatch in file order */
+	tuint32	first_y;
+	tbyte	max_error[4];	/* per channel */
+	double	psnr;		/* dB over the region, HUGE_VAL if equal */
+};
+
+/* a stage boundary, see TGASetTraceProc */
+struct _TGATraceEvent {
+	int		 stage;		/* TGA_TRACE_* */
+	int		 write;		/* encoding rather than decoding */
+	const TGA	*tga;		/* the handle, or the one of a TGADecoder */
+	tuint32		 width;		/* of the image, 0 before its header */
+	tuint32		 height;
+	tuint32		 row;		/* first row of a ROWS or CONVERT band */
+	tuint32		 rows;
+	tuint64		 bytes;		/* file bytes of the stage; decoded bytes
+					   for CONVERT, the file size (0 if
+					   unknown) for OPEN, the offset
+					   reached for CLOSE */
 };
 
 /* TGA image handle */
 struct _TGA {
 	FILE*		fd;		/* file stream */
-	tlong		off;		/* current offset in file*/
+	tuint64		off;		/* current offset in file*/
 	int		last;		/* last error code */
 	TGAHeader	hdr;		/* image header */
 	TGAErrorProc 	error;		/* user-defined error proc */
+	int		seekable;	/* 0 for pipes and sockets: sections are
+					   read/written strictly in file order,
+					   skipped ones are read and discarded */
+	tuint32		row;		/* next scanline of a sequential write */
+	tuint64		*row_off;	/* RLE scanline offsets, see TGABuildRowIndex */
+	tuint64		mem_limit;	/* bytes a read may allocate, 0 for no limit */
+	tuint64		size;		/* file size, 0 if unknown */
+	tbyte		*map;		/* output mapped by TGAWriteMapped */
+	tuint64		map_size;
+	const struct _TGAKernel *kernel; /* private: cached pixel kernel */
+	tuint32		kernel_key;
+	tbyte		*rle_tmp;	/* private: TGA_RLE_OPTIMAL tables */
+	size_t		rle_tmp_size;
 };
 
 TGA* TGAOpen(const char *name, const char *mode);
@@ -147,8 +310,68 @@ int TGAReadScanlines(TGA *tga, TGAData *data);
 
 int TGAReadImage(TGA *tga, TGAData *data);
 
+/* read the next scanline in file order; 15/16 bit scanlines are unpacked
+ * to 24 bit, so line must hold width * 3 bytes for those */
+int TGAReadScanline(TGA *tga, tbyte *line, tuint32 flags);
+
+/* size of a decoded scanline once the header is read, the image takes
+ * height scanlines of this size */
+size_t TGAScanlineSize(const TGA *tga);
+
+/* decode all scanlines in file order into dst, row_pitch bytes apart,
+ * without allocating anything. tga->hdr is left as is. */
+int TGAReadScanlinesInto(TGA *tga, tbyte *dst, size_t row_pitch,
+			 tuint32 flags);
+
+/* decode into fmt->planes planes of width * height elements each (CHW),
+ * rows in file order. Channels are numbered after TGA_RGB/TGA_BGR is
+ * applied; colormapped images are not supported. */
+int TGAReadPlanar(TGA *tga, void *dst, const TGAPlanar *fmt, tuint32 flags);
+
+/* downscaled decoding: the image is box-filtered by 1/scale while
+ * rows are decoded, so the result is TGA_SCALED_DIM(width, scale) by
+ * TGA_SCALED_DIM(height, scale) pixels. 15/16 bit images come out as
+ * 24 bit, colormapped images are point-sampled. tga->hdr is left as is. */
+int TGAReadScanlinesScaled(TGA *tga, TGAData *data, tuint8 scale);
+
+int TGAReadImageScaled(TGA *tga, TGAData *data, tuint8 scale);
+
 void TGAFreeTGAData(TGAData *data);
 
+/* positional reads: TGAReadRowsAt and TGAReadRegionAt use pread(2) with
+ * their own offsets and only read the handle, they do not touch the file
+ * position, tga->off or tga->last and return their error code. Once the
+ * header is read (and TGABuildRowIndex succeeded for RLE images) any
+ * number of threads may call them on the same handle, as long as no other
+ * call uses the handle meanwhile. Rows are stored tightly packed in file
+ * order and converted like TGAReadScanlines does. */
+int TGABuildRowIndex(TGA *tga);
+
+int TGAReadRowsAt(const TGA *tga, tbyte *buf, tuint32 first, tuint32 count,
+		  tuint32 flags);
+
+int TGAReadRegionAt(const TGA *tga, tbyte *buf, tuint32 x, tuint32 y,
+		    tuint32 w, tuint32 h, tuint32 flags);
+
+/* lazy decoding: a row is read and decoded, as by TGAReadScanline with
+ * flags, the first time it is asked for. RLE row offsets are recorded on
+ * the way and handed to tga->row_off once complete; the last cache_rows
+ * decoded rows are kept. A returned row stays valid for the next
+ * cache_rows - 1 calls. The header must be read, the handle seekable,
+ * and it is only read with pread(2). Not thread-safe. */
+TGALazy* TGALazyOpen(TGA *tga, tuint32 flags, size_t cache_rows);
+
+int TGALazyRow(TGALazy *lazy, tuint32 y, const tbyte **row);
+
+void TGALazyClose(TGALazy *lazy);
+
+/* read the postage stamp from the extension area of a TGA 2.0 file, the
+ * header must have been read. stamp->data is NULL if there is none or it
+ * is empty; offsets past the end of the file give TGA_TRUNCATED. */
+int TGAReadPostageStamp(TGA *tga, TGAStamp *stamp, tuint32 flags);
+
+void TGAFreePostageStamp(TGAStamp *stamp);
+
 int TGAWriteHeader(TGA *tga);
 
 int TGAWriteImageId(TGA *tga, TGAData *data);
@@ -159,8 +382,147 @@ size_t TGAWriteScanlines(TGA *tga, TGAData *ata);
 
 int TGAWriteImage(TGA *tga, TGAData *data);
 
+/* Turn the 24/32 bit truecolor img_data of tga into 8 bit indices and a
+ * color map of at most colors (0 for 256) entries in the same byte order,
+ * and make tga->hdr describe a color-mapped image for TGAWriteImage.
+ * Images with no more colors keep them exactly, images without pixels
+ * get an empty one. threads 0 uses one per online CPU; the result does
+ * not depend on it. */
+int TGAQuantize(TGA *tga, TGAData *data, tuint16 colors, tuint32 threads);
+
+/* Compare two images of the same size and format a band of rows at a
+ * time, with the positional reads, on several threads. Headers must be
+ * read and the handles seekable; RLE images get a row index. With
+ * first_only the results only cover the rows compared so far. Returns
+ * its error code. */
+int TGADiffImages(TGA *a, TGA *b, TGADiff *diff);
+
+/* Predict the RLE size of data->img_data from every step-th scanline,
+ * step 1 scans the whole image. opaque is only conclusive for step 1. */
+int TGAEstimateRLE(TGA *tga, const TGAData *data, tuint32 step,
+		   TGAEstimate *est);
+
+/* sequential writing: TGAWriteBegin emits header, image id and color map
+ * up front, then every scanline is written in file order, so no seeks
+ * are needed and the output may be a pipe or socket. */
+int TGAWriteBegin(TGA *tga, TGAData *data);
+
+int TGAWriteScanline(TGA *tga, tbyte *line, tuint32 flags);
+
+int TGAWriteEnd(TGA *tga);
+
+/* zero-copy writing of a raw image: the file is sized for header, image
+ * id, color map and pixels and mapped, the first three are written in
+ * place and *pixels points at the pixel data, in file byte order, to be
+ * rendered into. TGAWriteUnmap, or closing or rebinding tga, msyncs and
+ * unmaps it. The file must be open for reading too ("w+b"); with
+ * TGA_PREALLOCATE its blocks are reserved up front. */
+int TGAWriteMapped(TGA *tga, TGAData *data, tbyte **pixels);
+
+int TGAWriteUnmap(TGA *tga);
+
 void TGAClose(TGA *tga);
 
+/* rebind an existing handle to a new source, closing the previous one */
+int TGAReset(TGA *tga, FILE *fd);
+
+int TGAReopen(TGA *tga, const char *name, const char *mode);
+
+/* Reads check an image against these before allocating for it. The
+ * memory limit survives TGAReset/TGAReopen, the size is taken from
+ * regular files and must be set for streams. 0 disables a check. */
+void TGASetMemoryLimit(TGA *tga, tuint64 bytes);
+
+void TGASetStreamSize(TGA *tga, tuint64 bytes);
+
+/* thread-safe pool of idle handles and TGAData. Pooled TGAData keep
+ * TGA_KEEP_BUFFERS in their flags, so their buffers stay at the largest
+ * size needed so far instead of being reallocated for every image.
+ * Handles come back without error proc and memory limit, TGAData
+ * without stats. */
+TGAPool* TGAPoolNew(size_t capacity);
+
+void TGAPoolFree(TGAPool *pool);
+
+TGA* TGAPoolOpen(TGAPool *pool, const char *name, const char *mode);
+
+/* closes tga like TGAClose and parks it in the pool; returns the error
+ * of syncing a TGAWriteMapped output, which is unmapped first */
+int TGAPoolClose(TGAPool *pool, TGA *tga);
+
+TGAData* TGAPoolAcquireData(TGAPool *pool);
+
+void TGAPoolReleaseData(TGAPool *pool, TGAData *data);
+
+/* thread-safe LRU cache of TGAReadImage results, keyed by path, flags and
+ * the device, inode, size and mtime of the file, so rewritten files are
+ * loaded again. Idle images are evicted above max_bytes; images in use
+ * stay until released. Release everything before TGACacheFree. */
+TGACache* TGACacheNew(tuint64 max_bytes);
+
+void TGACacheFree(TGACache *cache);
+
+int TGACacheLoad(TGACache *cache, const char *name, tuint32 flags,
+		 const TGACached **image);
+
+void TGACacheRelease(TGACache *cache, const TGACached *image);
+
+/* pack files: TGA files back to back with a sorted name index at the end.
+ * A pack is mapped once by TGAPackOpen; TGAPackFind looks a member up by
+ * binary search and TGAPackOpenMember returns a handle reading it straight
+ * from the mapping, to be closed with TGAClose. Lookups may run in any
+ * number of threads. Names are bytes, compared as by strcmp. */
+TGAPackWriter* TGAPackCreate(const char *name);
+
+int TGAPackAdd(TGAPackWriter *w, const char *member, const tbyte *bytes,
+	       size_t size);
+
+int TGAPackAddFile(TGAPackWriter *w, const char *member, const char *file);
+
+/* writes the index and frees w, whether it succeeds or not */
+int TGAPackFinish(TGAPackWriter *w);
+
+TGAPack* TGAPackOpen(const char *name);
+
+void TGAPackClose(TGAPack *pack);
+
+size_t TGAPackCount(const TGAPack *pack);
+
+/* i-th name in index order, not 0-terminated */
+const char* TGAPackName(const TGAPack *pack, size_t i, size_t *len);
+
+const tbyte* TGAPackFind(const TGAPack *pack, const char *member,
+			 size_t *size);
+
+TGA* TGAPackOpenMember(const TGAPack *pack, const char *member);
+
+/* incremental decoding: bytes are pushed in chunks of any size, every
+ * scanline is passed to proc (and stored in data->img_data if
+ * TGA_IMAGE_DATA is set) as soon as it is complete. Scanlines come in
+ * file order and are converted like TGAReadScanlines does. */
+TGADecoder* TGADecoderNew(TGAData *data, TGAScanlineProc proc, void *user);
+
+int TGADecoderFeed(TGADecoder *dec, const tbyte *bytes, size_t len);
+
+const TGAHeader* TGADecoderHeader(const TGADecoder *dec);
+
+int TGADecoderDone(const TGADecoder *dec);
+
+void TGADecoderFree(TGADecoder *dec);
+
+/* as TGASetMemoryLimit and TGASetStreamSize, before the first feed */
+void TGADecoderSetLimits(TGADecoder *dec, tuint64 mem_limit,
+			 tuint64 stream_size);
+
+/* Tracing: with libtga built with TGA_TRACE, proc is called at every
+ * stage boundary: open, header, image id, color map, each band of rows
+ * read or written by one call, conversion and close. The same events are
+ * USDT probes libtga:open, header, image_id, color_map, rows, convert and
+ * close if sys/sdt.h was found, with the fields of the event as arguments.
+ * Without TGA_TRACE none of it is compiled in and proc is never called.
+ * proc may be called from any thread using libtga; set it before. */
+void TGASetTraceProc(TGATraceProc proc, void *user);
+
 void TGAClearError(TGA *tga);
 
 #define TGA_SUCCEEDED(TGA) (((TGA) != 0) && ((TGA)->last == TGA_OK))
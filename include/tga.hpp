@@ -0,0 +1,437 @@
+/*
+ *  tga.hpp - C++ interface to libtga
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __TGA_HPP
+#define __TGA_HPP
+
+#if __cplusplus < 202002L
+#error "tga.hpp requires C++20"
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <tga.h>
+
+namespace tga {
+
+/* pixel types, laid out as they are stored in memory */
+struct Gray8 { std::uint8_t v; };
+struct Bgr8  { std::uint8_t b, g, r; };
+struct Bgra8 { std::uint8_t b, g, r, a; };
+struct Rgb8  { std::uint8_t r, g, b; };
+struct Rgba8 { std::uint8_t r, g, b, a; };
+
+static_assert(sizeof(Gray8) == 1 && sizeof(Bgr8) == 3 && sizeof(Bgra8) == 4 &&
+	      sizeof(Rgb8) == 3 && sizeof(Rgba8) == 4,
+	      "pixel types must be tightly packed");
+
+template <class P> struct pixel_traits;
+template <> struct pixel_traits<Gray8> {
+	static constexpr tbyte depth = 8, alpha = 0, img_t = TGA_IMGTYPE_UNCOMP_BW;
+	static constexpr tuint32 order = TGA_BGR;
+};
+template <> struct pixel_traits<Bgr8> {
+	static constexpr tbyte depth = 24, alpha = 0, img_t = TGA_IMGTYPE_UNCOMP_TRUEC;
+	static constexpr tuint32 order = TGA_BGR;
+};
+template <> struct pixel_traits<Bgra8> {
+	static constexpr tbyte depth = 32, alpha = 8, img_t = TGA_IMGTYPE_UNCOMP_TRUEC;
+	static constexpr tuint32 order = TGA_BGR;
+};
+template <> struct pixel_traits<Rgb8> {
+	static constexpr tbyte depth = 24, alpha = 0, img_t = TGA_IMGTYPE_UNCOMP_TRUEC;
+	static constexpr tuint32 order = TGA_RGB;
+};
+template <> struct pixel_traits<Rgba8> {
+	static constexpr tbyte depth = 32, alpha = 8, img_t = TGA_IMGTYPE_UNCOMP_TRUEC;
+	static constexpr tuint32 order = TGA_RGB;
+};
+
+template <class P>
+concept Pixel = requires { pixel_traits<P>::depth; };
+
+namespace detail {
+
+/* what TGAReadScanline produces: 15/16 bit pixels unpack to 5 bit r, g, b */
+struct Rgb5 { std::uint8_t r, g, b; };
+struct Index8 { std::uint8_t i; };
+
+constexpr std::uint8_t
+expand5(std::uint8_t v)
+{
+	return static_cast<std::uint8_t>((v << 3) | (v >> 2));
+}
+
+template <class S>
+constexpr Rgba8
+to_rgba(S s)
+{
+	if constexpr (std::is_same_v<S, Gray8>) {
+		return {s.v, s.v, s.v, 255};
+	} else if constexpr (std::is_same_v<S, Rgb5>) {
+		return {expand5(s.r), expand5(s.g), expand5(s.b), 255};
+	} else if constexpr (requires { s.a; }) {
+		return {s.r, s.g, s.b, s.a};
+	} else {
+		return {s.r, s.g, s.b, 255};
+	}
+}
+
+template <class D>
+constexpr D
+from_rgba(Rgba8 c)
+{
+	if constexpr (std::is_same_v<D, Gray8>) {
+		return {static_cast<std::uint8_t>((77 * c.r + 150 * c.g + 29 * c.b) >> 8)};
+	} else if constexpr (std::is_same_v<D, Bgr8>) {
+		return {c.b, c.g, c.r};
+	} else if constexpr (std::is_same_v<D, Bgra8>) {
+		return {c.b, c.g, c.r, c.a};
+	} else if constexpr (std::is_same_v<D, Rgb8>) {
+		return {c.r, c.g, c.b};
+	} else {
+		return c;
+	}
+}
+
+template <class S, class D>
+constexpr D
+convert(S s)
+{
+	if constexpr (std::is_same_v<S, D>) {
+		return s;
+	} else {
+		return from_rgba<D>(to_rgba(s));
+	}
+}
+
+} /* namespace detail */
+
+
+/* libtga error code with its message */
+class error : public std::runtime_error {
+public:
+	explicit error(int code)
+		: std::runtime_error(TGAStrErrorCode(static_cast<tuint8>(code))),
+		  code_(code) {}
+
+	int code() const noexcept { return code_; }
+
+private:
+	int code_;
+};
+
+
+/* owning TGA* handle */
+class File {
+public:
+	File(const char *name, const char *mode)
+		: tga_(TGAOpen(name, mode))
+	{
+		if (!tga_) throw error(TGA_OPEN_FAIL);
+	}
+
+	/* takes ownership of fd, which is closed if it cannot be opened */
+	explicit File(FILE *fd)
+		: tga_(TGAOpenFd(fd))
+	{
+		if (!tga_) {
+			if (fd) std::fclose(fd);
+			throw error(TGA_OPEN_FAIL);
+		}
+	}
+
+	File(File &&other) noexcept : tga_(std::exchange(other.tga_, nullptr)) {}
+
+	File &
+	operator=(File &&other) noexcept
+	{
+		std::swap(tga_, other.tga_);
+		return *this;
+	}
+
+	File(const File &) = delete;
+	File &operator=(const File &) = delete;
+
+	~File() { TGAClose(tga_); }
+
+	TGA *get() const noexcept { return tga_; }
+
+	const TGAHeader &header() const noexcept { return tga_->hdr; }
+
+	TGAHeader &header() noexcept { return tga_->hdr; }
+
+	const TGAHeader &
+	read_header()
+	{
+		check(TGAReadHeader(tga_));
+		return tga_->hdr;
+	}
+
+	void
+	check(int code) const
+	{
+		if (code != TGA_OK || tga_->last != TGA_OK) {
+			throw error(tga_->last != TGA_OK ? tga_->last : code);
+		}
+	}
+
+private:
+	TGA *tga_;
+};
+
+
+/* owning TGAData, freed with TGAFreeTGAData */
+class Data {
+public:
+	explicit Data(tuint32 flags = 0) : data_{} { data_.flags = flags; }
+
+	Data(Data &&other) noexcept : data_(std::exchange(other.data_, TGAData{})) {}
+
+	Data &
+	operator=(Data &&other) noexcept
+	{
+		std::swap(data_, other.data_);
+		return *this;
+	}
+
+	Data(const Data &) = delete;
+	Data &operator=(const Data &) = delete;
+
+	~Data() { TGAFreeTGAData(&data_); }
+
+	TGAData *get() noexcept { return &data_; }
+
+	const TGAData *get() const noexcept { return &data_; }
+
+private:
+	TGAData data_;
+};
+
+
+/* Move-only image of pixel type P, rows in file order. Decoding
+ * dispatches on the file format once per image; the per-pixel loops are
+ * instantiated for each source/destination pair. */
+template <Pixel P>
+class Image {
+public:
+	Image() = default;
+
+	Image(tshort width, tshort height, bool top_down = true)
+		: width_(width), height_(height), top_down_(top_down),
+		  pixels_(static_cast<std::size_t>(width) * height) {}
+
+	/* a moved-from image is empty */
+	Image(Image &&other) noexcept
+		: width_(std::exchange(other.width_, 0)),
+		  height_(std::exchange(other.height_, 0)),
+		  top_down_(other.top_down_),
+		  pixels_(std::move(other.pixels_)) { other.pixels_.clear(); }
+
+	Image &
+	operator=(Image &&other) noexcept
+	{
+		if (this != &other) {
+			width_ = std::exchange(other.width_, 0);
+			height_ = std::exchange(other.height_, 0);
+			top_down_ = other.top_down_;
+			pixels_ = std::move(other.pixels_);
+			other.pixels_.clear();
+		}
+		return *this;
+	}
+	Image(const Image &) = delete;
+	Image &operator=(const Image &) = delete;
+
+	tshort width() const noexcept { return width_; }
+	tshort height() const noexcept { return height_; }
+	/* first row is the top of the picture */
+	bool top_down() const noexcept { return top_down_; }
+
+	std::span<P> pixels() noexcept { return pixels_; }
+	std::span<const P> pixels() const noexcept { return pixels_; }
+
+	std::span<P>
+	row(std::size_t y) noexcept
+	{
+		return std::span<P>(pixels_).subspan(y * width_, width_);
+	}
+
+	std::span<const P>
+	row(std::size_t y) const noexcept
+	{
+		return std::span<const P>(pixels_).subspan(y * width_, width_);
+	}
+
+	static Image
+	read(File &file)
+	{
+		const TGAHeader &hdr = file.read_header();
+		if (!(hdr.img_t & 0x3)) {
+			throw error(TGA_UNKNOWN_SUB_FORMAT);
+		}
+		Image img(hdr.width, hdr.height, hdr.vert == TGA_TOP);
+
+		if ((hdr.img_t & 0x3) == TGA_IMGTYPE_CMAP_FLAG) {
+			if (hdr.depth != 8) {
+				throw error(TGA_UNKNOWN_SUB_FORMAT);
+			}
+			img.decode_mapped(file, read_palette(file));
+			return img;
+		}
+
+		switch (hdr.depth) {
+		case 8:  img.decode<Gray8>(file);	 break;
+		case 15:
+		case 16: img.decode<detail::Rgb5>(file); break;
+		case 24: img.decode<Bgr8>(file);	 break;
+		case 32: img.decode<Bgra8>(file);	 break;
+		default: throw error(TGA_UNKNOWN_SUB_FORMAT);
+		}
+		return img;
+	}
+
+	static Image
+	read(const char *name)
+	{
+		File file(name, "rb");
+		return read(file);
+	}
+
+	/* writes in file order; works on pipes as well */
+	void
+	write(File &file, bool rle = false) const
+	{
+		using traits = pixel_traits<P>;
+		TGAHeader &hdr = file.header();
+		hdr = TGAHeader{};
+		hdr.img_t = traits::img_t;
+		hdr.width = width_;
+		hdr.height = height_;
+		hdr.depth = traits::depth;
+		hdr.alpha = traits::alpha;
+		hdr.vert = top_down_ ? TGA_TOP : TGA_BOTTOM;
+
+		Data data(TGA_IMAGE_DATA | traits::order |
+			  (rle ? TGA_RLE_ENCODE : 0));
+		file.check(TGAWriteBegin(file.get(), data.get()));
+
+		/* TGAWriteScanline swaps in place */
+		std::vector<P> line(width_);
+		for (std::size_t y = 0; y < height_; ++y) {
+			auto src = row(y);
+			std::copy(src.begin(), src.end(), line.begin());
+			file.check(TGAWriteScanline(file.get(),
+				reinterpret_cast<tbyte *>(line.data()),
+				data.get()->flags));
+		}
+		file.check(TGAWriteEnd(file.get()));
+	}
+
+	void
+	write(const char *name, bool rle = false) const
+	{
+		File file(name, "wb");
+		write(file, rle);
+	}
+
+private:
+	template <class S>
+	void
+	decode(File &file)
+	{
+		std::vector<S> line(width_);
+		file.get()->row = 0;
+		for (std::size_t y = 0; y < height_; ++y) {
+			file.check(TGAReadScanline(file.get(),
+				reinterpret_cast<tbyte *>(line.data()), TGA_BGR));
+			P *out = row(y).data();
+			for (std::size_t x = 0; x < width_; ++x) {
+				out[x] = detail::convert<S, P>(line[x]);
+			}
+		}
+	}
+
+	void
+	decode_mapped(File &file, const std::vector<P> &palette)
+	{
+		const tshort first = file.header().map_first;
+		std::vector<detail::Index8> line(width_);
+		file.get()->row = 0;
+		for (std::size_t y = 0; y < height_; ++y) {
+			file.check(TGAReadScanline(file.get(),
+				reinterpret_cast<tbyte *>(line.data()), TGA_BGR));
+			P *out = row(y).data();
+			for (std::size_t x = 0; x < width_; ++x) {
+				const std::size_t i = line[x].i - first;
+				out[x] = i < palette.size() ? palette[i] : P{};
+			}
+		}
+	}
+
+	static std::vector<P>
+	read_palette(File &file)
+	{
+		const TGAHeader &hdr = file.header();
+		Data data(TGA_BGR);
+		TGAReadColorMap(file.get(), data.get());
+		file.check(TGA_OK);
+		const tbyte *cmap = data.get()->cmap;
+		std::vector<P> palette(cmap ? hdr.map_len : 0);
+		for (std::size_t i = 0; i < palette.size(); ++i) {
+			switch (hdr.map_entry) {
+			case 15:
+			case 16:
+				palette[i] = detail::convert<detail::Rgb5, P>(
+					{cmap[i * 3], cmap[i * 3 + 1], cmap[i * 3 + 2]});
+				break;
+			case 24:
+				palette[i] = detail::convert<Bgr8, P>(
+					{cmap[i * 3], cmap[i * 3 + 1], cmap[i * 3 + 2]});
+				break;
+			case 32:
+				palette[i] = detail::convert<Bgra8, P>(
+					{cmap[i * 4], cmap[i * 4 + 1], cmap[i * 4 + 2],
+					 cmap[i * 4 + 3]});
+				break;
+			default:
+				throw error(TGA_UNKNOWN_SUB_FORMAT);
+			}
+		}
+		return palette;
+	}
+
+	tshort width_ = 0;
+	tshort height_ = 0;
+	bool top_down_ = true;
+	std::vector<P> pixels_;
+};
+
+} /* namespace tga */
+
+#endif /* __TGA_HPP */
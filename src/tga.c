@@ -19,9 +19,14 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
  
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
 #include <tga.h>
 #include "tga_private.h"
 
@@ -36,6 +41,8 @@ tga_error_strings[] =
 	"Read failed",
 	"Write failed",
 	"Unknown sub-format",
+	"Image too large",
+	"File truncated",
 };
 
 
@@ -52,6 +59,44 @@ TGA_handle_set_error(TGA *tga, tuint8 code)
 }
 
 
+/* Attach fd to tga, forgetting everything about the previous image. */
+static int
+bind_fd(TGA  *tga,
+	FILE *fd)
+{
+	int seekable = 1;
+	off_t offset = ftello(fd);
+	if (offset == -1) {
+		if (errno != ESPIPE) {
+			return TGA_OPEN_FAIL;
+		}
+		seekable = 0;
+		offset = 0;
+	}
+
+	/* memory streams have no descriptor */
+	struct stat st;
+	int fdno = fileno(fd);
+	tga->size = 0;
+	if (seekable && fdno >= 0 && fstat(fdno, &st) == 0 &&
+	    S_ISREG(st.st_mode)) {
+		tga->size = st.st_size;
+	}
+
+	tga->fd = fd;
+	tga->off = offset;
+	bzero(&tga->hdr, sizeof(TGAHeader));
+	tga->last = TGA_OK;
+	tga->seekable = seekable;
+	tga->row = 0;
+	free(tga->row_off);
+	tga->row_off = NULL;
+	tga->kernel = NULL;
+	TGA_TRACE_EVENT(OPEN, tga, 0, 0, 0, tga->size);
+	return TGA_OK;
+}
+
+
 TGA *
 TGAOpen(const char *file, 
 	const char *mode)
@@ -69,11 +114,18 @@ TGAOpen(const char *file,
 		return NULL;
 	}
 
-	tga->fd = fd;
-	tga->off = 0;
-	bzero(&tga->hdr, sizeof(TGAHeader));
-	tga->last = TGA_OK;
 	tga->error = (TGAErrorProc) 0;
+	tga->row_off = NULL;
+	tga->rle_tmp = NULL;
+	tga->rle_tmp_size = 0;
+	tga->mem_limit = 0;
+	tga->map = NULL;
+	tga->map_size = 0;
+	if (bind_fd(tga, fd) != TGA_OK) {
+		fclose(fd);
+		free(tga);
+		return NULL;
+	}
 	return tga;
 }
 
@@ -93,19 +145,123 @@ TGAOpenFd(FILE *fd)
 		return NULL;
 	}
 
-	long offset = ftell(fd);
-	if (offset == -1) {
+	tga->error = (TGAErrorProc) 0;
+	tga->row_off = NULL;
+	tga->rle_tmp = NULL;
+	tga->rle_tmp_size = 0;
+	tga->mem_limit = 0;
+	tga->map = NULL;
+	tga->map_size = 0;
+	if (bind_fd(tga, fd) != TGA_OK) {
 		TGA_ERROR(tga, TGA_OPEN_FAIL);
 		free(tga);
 		return NULL;
 	}
+	return tga;
+}
+
+
+int
+TGAReset(TGA  *tga,
+	 FILE *fd)
+{
+	if (!tga) return TGA_ERROR;
+	if (!fd) {
+		TGA_ERROR(tga, TGA_OPEN_FAIL);
+		return __TGA_LASTERR(tga);
+	}
 
+	TGAWriteUnmap(tga);
+	if (tga->fd && tga->fd != fd) {
+		TGA_TRACE_EVENT(CLOSE, tga, 0, 0, 0, tga->off);
+		fclose(tga->fd);
+	}
 	tga->fd = fd;
-	tga->off = offset;
-	bzero(&tga->hdr, sizeof(TGAHeader));
-	tga->last = TGA_OK;
-	tga->error = (TGAErrorProc) 0;
-	return tga;
+	if (bind_fd(tga, fd) != TGA_OK) {
+		TGA_ERROR(tga, TGA_OPEN_FAIL);
+	}
+	return __TGA_LASTERR(tga);
+}
+
+
+int
+TGAReopen(TGA	     *tga,
+	  const char *file,
+	  const char *mode)
+{
+	if (!tga) return TGA_ERROR;
+
+	TGAWriteUnmap(tga);
+	/* freopen recycles the FILE of the previous source */
+	FILE *fd = tga->fd ? freopen(file, mode, tga->fd) : fopen(file, mode);
+	if (!fd) {
+		tga->fd = NULL;
+		TGA_ERROR(tga, TGA_OPEN_FAIL);
+		return __TGA_LASTERR(tga);
+	}
+
+	if (bind_fd(tga, fd) != TGA_OK) {
+		TGA_ERROR(tga, TGA_OPEN_FAIL);
+	}
+	return __TGA_LASTERR(tga);
+}
+
+
+void
+TGASetMemoryLimit(TGA	  *tga,
+		  tuint64  bytes)
+{
+	if (tga) {
+		tga->mem_limit = bytes;
+	}
+}
+
+
+void
+TGASetStreamSize(TGA	 *tga,
+		 tuint64  bytes)
+{
+	if (tga) {
+		tga->size = bytes;
+	}
+}
+
+
+/* RLE packets cover at most 128 pixels. The per-scanline bound only holds
+ * for the readers that reject packets crossing a scanline; the others
+ * can only rely on the pixel count of the whole image. */
+tuint64
+__TGAMinFileSize(const TGA *tga,
+		 int	    cross)
+{
+	if (!TGA_IMGTYPE_AVAILABLE(tga)) {
+		return TGA_CMAP_OFF(tga);
+	}
+	if (!TGA_IMGTYPE_IS_ENCODED(tga)) {
+		return TGA_IMG_DATA_OFF(tga) + TGA_IMG_DATA_SIZE(tga);
+	}
+	const tuint64 packets = cross ?
+		((tuint64) tga->hdr.width * tga->hdr.height + 127) / 128 :
+		(tuint64) tga->hdr.height * ((tga->hdr.width + 127) / 128);
+	return TGA_IMG_DATA_OFF(tga) + packets *
+		(1 + TGA_PIXEL_SIZE(tga->hdr.depth));
+}
+
+
+int
+__TGACheckLimits(TGA	 *tga,
+		 tuint64  file_size,
+		 tuint64  alloc)
+{
+	if (tga->size && file_size > tga->size) {
+		TGA_ERROR(tga, TGA_TRUNCATED);
+		return __TGA_LASTERR(tga);
+	}
+	if (tga->mem_limit && alloc > tga->mem_limit) {
+		TGA_ERROR(tga, TGA_TOO_LARGE);
+		return __TGA_LASTERR(tga);
+	}
+	return TGA_OK;
 }
 
 
@@ -113,7 +269,13 @@ void
 TGAClose(TGA *tga)
 {
 	if (tga) {
-		fclose(tga->fd);
+		TGAWriteUnmap(tga);
+		TGA_TRACE_EVENT(CLOSE, tga, 0, 0, 0, tga->off);
+		if (tga->fd) {
+			fclose(tga->fd);
+		}
+		free(tga->row_off);
+		free(tga->rle_tmp);
 		free(tga);
 	}
 }
@@ -124,7 +286,9 @@ TGAClearError(TGA *tga)
 {
 	if (tga) {
 		tga->last = TGA_OK;
-		clearerr(tga->fd);
+		if (tga->fd) {
+			clearerr(tga->fd);
+		}
 	}
 }
 
@@ -144,15 +308,46 @@ TGAStrErrorCode(tuint8 code)
 }
 
 
-tlong
-__TGASeek(TGA  *tga, 
-	  tlong off, 
-	  int   whence)
+/* Forward "seek" on a stream: read and discard. */
+static void
+skip_forward(TGA     *tga,
+	     tuint64  n)
 {
-	fseek(tga->fd, off, whence);
-	long offset = ftell(tga->fd);
+	tbyte buf[4096];
+	while (n > 0) {
+		size_t chunk = n < sizeof(buf) ? n : sizeof(buf);
+		size_t read = fread(buf, 1, chunk, tga->fd);
+		tga->off += read;
+		n -= read;
+		if (read != chunk) {
+			TGA_ERROR(tga, TGA_SEEK_FAIL);
+			return;
+		}
+	}
+}
+
+
+tuint64
+__TGASeek(TGA	  *tga,
+	  tuint64  off,
+	  int	   whence)
+{
+	if (!tga->seekable) {
+		if (whence != SEEK_SET || off < tga->off) {
+			TGA_ERROR(tga, TGA_SEEK_FAIL);
+			return tga->off;
+		}
+		skip_forward(tga, off - tga->off);
+		return tga->off;
+	}
+
+	off_t offset = -1;
+	if (fseeko(tga->fd, (off_t) off, whence) == 0) {
+		offset = ftello(tga->fd);
+	}
 	if (offset == -1) {
 		TGA_ERROR(tga, TGA_SEEK_FAIL);
+		return tga->off;
 	}
 	tga->off = offset;
 	return tga->off;
@@ -170,3 +365,82 @@ __TGAbgr2rgb(tbyte  *data,
 		data[i + 2] = tmp;
 	}
 }
+
+
+void
+__TGAunpack16(const tbyte *src,
+	      tbyte	  *dst)
+{
+	tlong tmp = src[0] + src[1] * 256;
+	dst[0] = (tmp >> 10) & 0x1F;
+	dst[1] = (tmp >> 5) & 0x1F;
+	dst[2] = tmp & 0x1F;
+}
+
+
+/* Unpack n 16 bit pixels to 24 bit in place, back to front so the
+ * 24 bit pixels can overlay the 16 bit ones. buf holds n * 3 bytes. */
+void
+__TGAunpack16row(tbyte  *buf,
+		 size_t  n)
+{
+	for (size_t i = n; i-- > 0;) {
+		__TGAunpack16(buf + i * 2, buf + i * 3);
+	}
+}
+
+
+tbyte *
+__TGAReserve(TGAData  *data,
+	     tbyte   **buf,
+	     size_t   *size,
+	     size_t    n)
+{
+	if ((data->flags & TGA_KEEP_BUFFERS) && *buf && *size >= n) {
+		return *buf;
+	}
+
+	tbyte *p = (tbyte*) realloc(*buf, n ? n : 1);
+	if (!p) {
+		return NULL;
+	}
+	*buf = p;
+	*size = n;
+	return p;
+}
+
+
+/* Decode one RLE scanline of width pixels from src into dst, or just
+ * validate it if dst is NULL. Returns the number of bytes consumed, 0 if
+ * src is truncated or a packet crosses the end of the scanline. */
+size_t
+__TGADecodeRLE(const tbyte *src,
+	       size_t	    len,
+	       tbyte	   *dst,
+	       size_t	    width,
+	       size_t	    sample_bytes)
+{
+	size_t pos = 0;
+	for (size_t x = 0; x < width;) {
+		if (pos >= len) return 0;
+		tbyte packet_head = src[pos++];
+		size_t n = 1 + (packet_head & 0x7f);
+		if (x + n > width) return 0;
+
+		size_t bytes = (packet_head & 0x80) ? sample_bytes : n * sample_bytes;
+		if (pos + bytes > len) return 0;
+		if (dst) {
+			if (packet_head & 0x80) {
+				for (size_t i = 0; i < n; ++i) {
+					memcpy(dst + (x + i) * sample_bytes, src + pos,
+						sample_bytes);
+				}
+			} else {
+				memcpy(dst + x * sample_bytes, src + pos, bytes);
+			}
+		}
+		pos += bytes;
+		x += n;
+	}
+	return pos;
+}
@@ -3,18 +3,120 @@
 
 #include <tga.h>
 
-tlong __TGASeek(TGA *tga, tlong off, int whence);
+tuint64 __TGASeek(TGA *tga, tuint64 off, int whence);
+
+size_t TGARead(TGA *tga, tbyte *buf, size_t size, size_t n);
+
+size_t TGAWrite(TGA *tga, const tbyte *buf, size_t size, size_t n);
+
+/* Smallest file that can hold the whole image. cross is set for readers
+ * that accept RLE packets crossing scanlines, which lowers the bound. */
+tuint64 __TGAMinFileSize(const TGA *tga, int cross);
+
+/* TGA_TRUNCATED if the file is shorter than file_size, TGA_TOO_LARGE if
+ * alloc exceeds the memory limit of tga */
+int __TGACheckLimits(TGA *tga, tuint64 file_size, tuint64 alloc);
 
 void __TGAbgr2rgb(tbyte *data, size_t size, size_t stride);
 
+void __TGAunpack16(const tbyte *src, tbyte *dst);
+
+int __TGAParseHeader(TGA *tga, const tbyte *buf);
+
+void __TGAunpack16row(tbyte *buf, size_t n);
+
+tbyte *__TGAReserve(TGAData *data, tbyte **buf, size_t *size, size_t n);
+
+size_t __TGADecodeRLE(const tbyte *src, size_t len, tbyte *dst,
+		      size_t width, size_t sample_bytes);
+
+/* pread(2) all n bytes, TGA_READ_FAIL on errors and end of file */
+int __TGAPreadFull(int fd, tbyte *buf, size_t n, tuint64 off);
+
+void __TGAScaleAccumulate(tuint32 *acc, const tbyte *row, size_t width,
+			  size_t sample_bytes, size_t channels, size_t scale);
+
+void __TGAScaleAverage(tuint32 *acc, tbyte *out, size_t width,
+		       size_t channels, size_t scale, size_t rows);
+
+void __TGAPackHeader(const TGA *tga, tbyte *buf);
+
+tbyte *__TGAMakeExtension(TGA *tga, TGAData *data, tuint64 off,
+			  size_t *stamp_size, tbyte *ext, tbyte *footer);
+
+int __TGAWriteImageV(TGA *tga, TGAData *data);
+
+/* Scanline kernels of one pixel format, picked once per image by
+ * __TGASelectKernel from the bit depth, TGA_RGB and TGA_RLE_OPTIMAL.
+ * convert turns n file pixels into output pixels and may work in place;
+ * swap is the RGB swap alone, for writers. Unused steps are NULL. */
+typedef struct _TGAKernel {
+	int	(*read_rle)(TGA *tga, tbyte *line);
+	int	(*write_rle)(TGA *tga, tbyte *line);
+	/* into out, which holds width * (sample_bytes + 1) bytes; tmp is
+	 * from __TGARLETmp, only used with TGA_RLE_OPTIMAL */
+	size_t	(*encode_rle)(const tbyte *line, size_t width, tbyte *out,
+			      void *tmp);
+	void	(*swap)(const tbyte *src, tbyte *dst, size_t n);
+	void	(*convert)(const tbyte *src, tbyte *dst, size_t n);
+	size_t	sample_bytes;	/* per pixel in the file */
+	size_t	out_bytes;	/* per pixel after convert */
+} TGAKernel;
+
+/* NULL for bit depths libtga cannot handle */
+const TGAKernel *__TGASelectKernel(tbyte depth, tuint32 flags);
+
+/* The kernel of the image's depth for flags, cached in the handle when
+ * the header is read or written and reselected only when the depth or
+ * the flags that pick it change. The const variant does not update the
+ * cache, for positional reads from several threads. */
+const TGAKernel *__TGAKernel(TGA *tga, tuint32 flags);
+const TGAKernel *__TGACachedKernel(const TGA *tga, tuint32 flags);
+
+/* Scratch tables of the TGA_RLE_OPTIMAL encoder for a scanline of the
+ * image, kept in the handle so they are allocated once per image and
+ * freed by TGAClose. NULL if out of memory. */
+void *__TGARLETmp(TGA *tga);
+
+/* running state of a TGAStats, fed one decoded scanline at a time */
+typedef struct _TGAStatsCtx {
+	TGAStats	*out;
+	size_t		 channels;
+	int		 alpha;		/* last channel is alpha */
+	tuint64		 lane[4];	/* xxHash64 accumulators */
+	tbyte		 buf[32];	/* xxHash64 input not consumed yet */
+	size_t		 buf_fill;
+	tuint64		 total;
+	tuint32		 crc_table[256];
+} TGAStatsCtx;
+
+void __TGAStatsBegin(TGAStatsCtx *ctx, TGAStats *stats, size_t channels,
+		     int alpha);
+
+void __TGAStatsUpdate(TGAStatsCtx *ctx, const tbyte *line, size_t size);
+
+void __TGAStatsEnd(TGAStatsCtx *ctx);
+
 #define TGA_HEADER_SIZE         18
-#define TGA_CMAP_SIZE(tga)      ((tga)->hdr.map_len * (tga)->hdr.map_entry / 8)
-#define TGA_CMAP_OFF(tga) 	(TGA_HEADER_SIZE + (tga)->hdr.id_len)
-#define TGA_IMG_DATA_OFF(tga) 	(TGA_HEADER_SIZE + (tga)->hdr.id_len + TGA_CMAP_SIZE(tga))
-#define TGA_IMG_DATA_SIZE(tga)	((tga)->hdr.width * (tga)->hdr.height * (tga)->hdr.depth / 8)
-#define TGA_SCANLINE_SIZE(tga)	((tga)->hdr.width * (tga)->hdr.depth / 8)
+/* all sizes and offsets are 64 bit: a 65535x65535x32 image is ~17 GB */
+#define TGA_PIXEL_SIZE(depth)   (((depth) + 7) / 8)
+#define TGA_CMAP_SIZE(tga)      ((tuint64) (tga)->hdr.map_len * TGA_PIXEL_SIZE((tga)->hdr.map_entry))
+#define TGA_CMAP_OFF(tga) 	((tuint64) TGA_HEADER_SIZE + (tga)->hdr.id_len)
+#define TGA_IMG_DATA_OFF(tga) 	(TGA_CMAP_OFF(tga) + TGA_CMAP_SIZE(tga))
+#define TGA_IMG_DATA_SIZE(tga)	((tga)->hdr.height * TGA_SCANLINE_SIZE(tga))
+#define TGA_SCANLINE_SIZE(tga)	((tuint64) (tga)->hdr.width * TGA_PIXEL_SIZE((tga)->hdr.depth))
+/* whether a buffer of n bytes can be allocated at all */
+#define TGA_SIZE_OK(n)          ((tuint64) (n) <= (tuint64) SIZE_MAX)
 #define TGA_CAN_SWAP(depth)     (depth == 24 || depth == 32)
 
+/* TGA 2.0 extension area and footer */
+#define TGA_FOOTER_SIZE         26
+#define TGA_EXT_SIZE            495
+#define TGA_EXT_STAMP_OFF       486
+#define TGA_EXT_ATTR_OFF        494
+#define TGA_STAMP_MAX           64
+#define TGA_SIGNATURE           "TRUEVISION-XFILE."
+
 #define TGA_IS_BW(tga)          ((((tga)->hdr.img_t & 0x3)==0x3) ? 1 : 0)
 
 const char *__TGAStrError(tuint8 code);
@@ -40,6 +142,47 @@ tuint8 TGA_handle_set_error(TGA *tga, tuint8 code);
 #endif
 
 
+/* TGA_TRACE_EVENT(STAGE, tga, write, row, rows, bytes) reports the end
+ * of stage TGA_TRACE_##STAGE of tga to the trace proc and the USDT probe
+ * of that stage */
+#ifdef TGA_TRACE
+extern TGATraceProc __TGATraceProc;
+extern void *__TGATraceUser;
+
+#define TGA_PROBE_OPEN		open
+#define TGA_PROBE_HEADER	header
+#define TGA_PROBE_IMAGE_ID	image_id
+#define TGA_PROBE_COLOR_MAP	color_map
+#define TGA_PROBE_ROWS		rows
+#define TGA_PROBE_CONVERT	convert
+#define TGA_PROBE_CLOSE		close
+
+#ifdef TGA_HAVE_SDT
+#include <sys/sdt.h>
+#define TGA_TRACE_PROBE(STAGE, ev) \
+	DTRACE_PROBE7(libtga, TGA_PROBE_##STAGE, (ev).tga, (ev).write, \
+		(ev).width, (ev).height, (ev).row, (ev).rows, (ev).bytes)
+#else
+#define TGA_TRACE_PROBE(STAGE, ev)
+#endif
+
+#define TGA_TRACE_EVENT(STAGE, tga_, write_, row_, rows_, bytes_) \
+	do { \
+		const TGATraceEvent ev_ = { TGA_TRACE_##STAGE, (write_), \
+			(tga_), (tga_)->hdr.width, (tga_)->hdr.height, \
+			(row_), (rows_), (bytes_) }; \
+		TGA_TRACE_PROBE(STAGE, ev_); \
+		if (__TGATraceProc) { \
+			__TGATraceProc(&ev_, __TGATraceUser); \
+		} \
+	} while (0)
+#else
+/* no code, but locals only passed here are not unused */
+#define TGA_TRACE_EVENT(STAGE, tga, write, row, rows, bytes) \
+	((void) sizeof ((row) + (rows) + (bytes)))
+#endif
+
+
 #define TGA_ERROR(tga, code) \
 	do { \
 		TGA_DBG_PRINTF("%s:%u %s\n", __FILE__, __LINE__, TGAStrErrorCode(code)); \
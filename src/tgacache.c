@@ -0,0 +1,376 @@
+/*
+ *  tgacache.c - Shared cache of decoded images
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* st_mtim */
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <tga.h>
+#include "tga_private.h"
+
+/* flags that do not change what a load produces */
+#define CACHE_IGNORED_FLAGS (TGA_KEEP_BUFFERS | TGA_STATS)
+
+typedef struct _CacheEntry CacheEntry;
+
+struct _CacheEntry {
+	TGACached	 image;		/* handed out, must stay first */
+	char		*name;
+	tuint32		 flags;
+	dev_t		 dev;		/* identity of the file when loaded */
+	ino_t		 ino;
+	off_t		 size;
+	struct timespec	 mtime;
+	size_t		 hash;
+	tuint64		 bytes;		/* charged against the cache */
+	size_t		 refs;
+	int		 cached;	/* still in the table */
+	CacheEntry	*next;		/* hash chain */
+	CacheEntry	*prev_lru;	/* toward the most recently used */
+	CacheEntry	*next_lru;
+};
+
+struct _TGACache {
+	pthread_mutex_t	lock;
+	tuint64		max_bytes;
+	tuint64		bytes;
+	size_t		n;
+	size_t		n_buckets;	/* power of two */
+	CacheEntry	**buckets;
+	CacheEntry	*head;		/* most recently used */
+	CacheEntry	*tail;
+};
+
+
+/* FNV-1a over the name, with the flags mixed in */
+static size_t
+hash_key(const char *name,
+	 tuint32     flags)
+{
+	tuint64 h = 14695981039346656037ULL;
+	for (; *name; ++name) {
+		h = (h ^ (tbyte) *name) * 1099511628211ULL;
+	}
+	h = (h ^ flags) * 1099511628211ULL;
+	return (size_t) (h ^ (h >> 32));
+}
+
+
+static void
+entry_free(CacheEntry *e)
+{
+	TGAFreeTGAData(&e->image.data);
+	free(e->name);
+	free(e);
+}
+
+
+static void
+lru_unlink(TGACache   *cache,
+	   CacheEntry *e)
+{
+	if (e->prev_lru) e->prev_lru->next_lru = e->next_lru;
+	else cache->head = e->next_lru;
+	if (e->next_lru) e->next_lru->prev_lru = e->prev_lru;
+	else cache->tail = e->prev_lru;
+	e->prev_lru = e->next_lru = NULL;
+}
+
+
+static void
+lru_push(TGACache   *cache,
+	 CacheEntry *e)
+{
+	e->prev_lru = NULL;
+	e->next_lru = cache->head;
+	if (cache->head) cache->head->prev_lru = e;
+	else cache->tail = e;
+	cache->head = e;
+}
+
+
+/* Take e out of the table; it is freed here or by its last release. */
+static void
+drop(TGACache	*cache,
+     CacheEntry *e)
+{
+	CacheEntry **p = &cache->buckets[e->hash & (cache->n_buckets - 1)];
+	while (*p != e) {
+		p = &(*p)->next;
+	}
+	*p = e->next;
+	lru_unlink(cache, e);
+	cache->bytes -= e->bytes;
+	cache->n -= 1;
+	e->cached = 0;
+	if (e->refs == 0) {
+		entry_free(e);
+	}
+}
+
+
+/* Drop idle entries, least recently used first, until under budget. */
+static void
+evict(TGACache *cache)
+{
+	CacheEntry *e = cache->tail;
+	while (e && cache->bytes > cache->max_bytes) {
+		CacheEntry *prev = e->prev_lru;
+		if (e->refs == 0) {
+			drop(cache, e);
+		}
+		e = prev;
+	}
+}
+
+
+static void
+grow(TGACache *cache)
+{
+	const size_t n = cache->n_buckets * 2;
+	CacheEntry **buckets = (CacheEntry**) calloc(n, sizeof(CacheEntry*));
+	if (!buckets) {
+		return;		/* longer chains, still correct */
+	}
+	for (size_t i = 0; i < cache->n_buckets; ++i) {
+		CacheEntry *e = cache->buckets[i];
+		while (e) {
+			CacheEntry *next = e->next;
+			e->next = buckets[e->hash & (n - 1)];
+			buckets[e->hash & (n - 1)] = e;
+			e = next;
+		}
+	}
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->n_buckets = n;
+}
+
+
+static int
+same_file(const CacheEntry  *e,
+	  const struct stat *st)
+{
+	return e->dev == st->st_dev && e->ino == st->st_ino &&
+		e->size == st->st_size &&
+		e->mtime.tv_sec == st->st_mtim.tv_sec &&
+		e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+/* The entry for name and flags, after dropping ones of an older file.
+ * Called with the lock held. */
+static CacheEntry *
+lookup(TGACache		 *cache,
+       const char	 *name,
+       tuint32		  flags,
+       size_t		  hash,
+       const struct stat *st)
+{
+	CacheEntry *e = cache->buckets[hash & (cache->n_buckets - 1)];
+	while (e) {
+		CacheEntry *next = e->next;
+		if (e->hash == hash && e->flags == flags && !strcmp(e->name, name)) {
+			if (same_file(e, st)) {
+				return e;
+			}
+			drop(cache, e);
+		}
+		e = next;
+	}
+	return NULL;
+}
+
+
+static CacheEntry *
+load(const char	       *name,
+     tuint32		flags,
+     size_t		hash,
+     const struct stat *st,
+     int	       *err)
+{
+	CacheEntry *e = (CacheEntry*) calloc(1, sizeof(CacheEntry));
+	char *copy = (char*) malloc(strlen(name) + 1);
+	if (!e || !copy) {
+		free(e);
+		free(copy);
+		*err = TGA_OOM;
+		return NULL;
+	}
+	strcpy(copy, name);
+
+	TGA *tga = TGAOpen(name, "rb");
+	if (!tga) {
+		free(e);
+		free(copy);
+		*err = TGA_OPEN_FAIL;
+		return NULL;
+	}
+	e->image.data.flags = flags;
+	*err = TGAReadImage(tga, &e->image.data);
+	e->image.hdr = tga->hdr;
+	TGAClose(tga);
+	if (*err != TGA_OK) {
+		TGAFreeTGAData(&e->image.data);
+		free(e);
+		free(copy);
+		return NULL;
+	}
+
+	e->name = copy;
+	e->flags = flags;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim;
+	e->hash = hash;
+	e->bytes = sizeof(CacheEntry) + strlen(name) + 1 +
+		e->image.data.img_id_size + e->image.data.cmap_size +
+		e->image.data.img_data_size;
+	e->refs = 1;
+	return e;
+}
+
+
+TGACache*
+TGACacheNew(tuint64 max_bytes)
+{
+	TGACache *cache = (TGACache*) calloc(1, sizeof(TGACache));
+	if (!cache) {
+		return NULL;
+	}
+
+	cache->max_bytes = max_bytes;
+	cache->n_buckets = 64;
+	cache->buckets = (CacheEntry**) calloc(cache->n_buckets,
+		sizeof(CacheEntry*));
+	if (!cache->buckets || pthread_mutex_init(&cache->lock, NULL)) {
+		free(cache->buckets);
+		free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+
+void
+TGACacheFree(TGACache *cache)
+{
+	if (!cache) return;
+
+	CacheEntry *e = cache->head;
+	while (e) {
+		CacheEntry *next = e->next_lru;
+		entry_free(e);
+		e = next;
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+
+int
+TGACacheLoad(TGACache	      *cache,
+	     const char	      *name,
+	     tuint32	       flags,
+	     const TGACached **image)
+{
+	if (!cache || !name || !image) return TGA_ERROR;
+	*image = NULL;
+
+	struct stat st;
+	if (stat(name, &st)) {
+		return TGA_OPEN_FAIL;
+	}
+	flags &= ~CACHE_IGNORED_FLAGS;
+	const size_t hash = hash_key(name, flags);
+
+	pthread_mutex_lock(&cache->lock);
+	CacheEntry *e = lookup(cache, name, flags, hash, &st);
+	if (e) {
+		e->refs += 1;
+		lru_unlink(cache, e);
+		lru_push(cache, e);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if (e) {
+		*image = &e->image;
+		return TGA_OK;
+	}
+
+	/* decode without the lock; concurrent misses of one image each
+	 * decode it and the first to get back wins */
+	int err;
+	e = load(name, flags, hash, &st, &err);
+	if (!e) {
+		return err;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	CacheEntry *other = lookup(cache, name, flags, hash, &st);
+	if (other) {
+		other->refs += 1;
+		lru_unlink(cache, other);
+		lru_push(cache, other);
+		entry_free(e);
+		e = other;
+	} else if (e->bytes <= cache->max_bytes) {
+		CacheEntry **bucket = &cache->buckets[hash & (cache->n_buckets - 1)];
+		e->next = *bucket;
+		*bucket = e;
+		e->cached = 1;
+		lru_push(cache, e);
+		cache->bytes += e->bytes;
+		cache->n += 1;
+		evict(cache);
+		if (cache->n > cache->n_buckets) {
+			grow(cache);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	*image = &e->image;
+	return TGA_OK;
+}
+
+
+void
+TGACacheRelease(TGACache	*cache,
+		const TGACached *image)
+{
+	if (!cache || !image) return;
+
+	CacheEntry *e = (CacheEntry*) image;
+	pthread_mutex_lock(&cache->lock);
+	e->refs -= 1;
+	if (e->refs == 0) {
+		if (!e->cached) {
+			entry_free(e);
+		} else if (cache->bytes > cache->max_bytes) {
+			evict(cache);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,476 @@
+/*
+ *  tgadecoder.c - Incremental (push-style) decoding
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tga.h>
+#include "tga_private.h"
+
+/* decoder states, in file order */
+enum {
+	DEC_HEADER = 0,
+	DEC_IMAGE_ID,
+	DEC_COLOR_MAP,
+	DEC_PIXELS,		/* uncompressed image data */
+	DEC_PACKET_HEAD,	/* RLE packet header byte */
+	DEC_RUN_SAMPLE,		/* the single sample of a run-length packet */
+	DEC_RAW_SAMPLES,	/* the samples of a raw packet */
+	DEC_DONE
+};
+
+/* sections the caller wants in dec->data */
+#define WANT(dec, section) ((dec)->data && ((dec)->data->flags & (section)))
+
+struct _TGADecoder {
+	TGA		tga;		/* header and error state, fd unused */
+	TGAData		*data;		/* user-provided output, may be NULL */
+	TGAScanlineProc	proc;		/* called for every decoded scanline */
+	void		*user;
+	int		state;
+	size_t		fill;		/* bytes collected in the current section */
+	size_t		need;		/* bytes left in the current section/packet */
+	tbyte		hdr[TGA_HEADER_SIZE];
+	tbyte		sample[4];
+	tuint32		run;		/* pixels left in the current run packet */
+	size_t		sample_bytes;
+	size_t		line_size;	/* scanline size in file format */
+	size_t		out_size;	/* scanline size after conversion */
+	size_t		line_fill;
+	tbyte		*line;
+	tbyte		*out;
+	tshort		row;
+	const TGAKernel	*kernel;	/* pixel conversion of this image */
+	TGAStatsCtx	stats;		/* with TGA_STATS */
+};
+
+
+TGADecoder*
+TGADecoderNew(TGAData	      *data,
+	      TGAScanlineProc  proc,
+	      void	      *user)
+{
+	TGADecoder *dec = (TGADecoder*) calloc(1, sizeof(TGADecoder));
+	if (!dec) {
+		return NULL;
+	}
+
+	dec->data = data;
+	dec->proc = proc;
+	dec->user = user;
+	dec->state = DEC_HEADER;
+	dec->tga.last = TGA_OK;
+	if (data && !(data->flags & TGA_KEEP_BUFFERS)) {
+		data->img_id = (tbyte *) 0;
+		data->cmap = (tbyte *) 0;
+		data->img_data = (tbyte *) 0;
+		data->img_id_size = 0;
+		data->cmap_size = 0;
+		data->img_data_size = 0;
+	}
+	return dec;
+}
+
+
+void
+TGADecoderFree(TGADecoder *dec)
+{
+	if (dec) {
+		free(dec->line);
+		if (dec->out != dec->line) {
+			free(dec->out);
+		}
+		free(dec);
+	}
+}
+
+
+void
+TGADecoderSetLimits(TGADecoder *dec,
+		    tuint64	mem_limit,
+		    tuint64	stream_size)
+{
+	if (dec) {
+		dec->tga.mem_limit = mem_limit;
+		dec->tga.size = stream_size;
+	}
+}
+
+
+const TGAHeader*
+TGADecoderHeader(const TGADecoder *dec)
+{
+	if (!dec || dec->state <= DEC_HEADER) {
+		return NULL;
+	}
+	return &dec->tga.hdr;
+}
+
+
+int
+TGADecoderDone(const TGADecoder *dec)
+{
+	return dec && dec->state == DEC_DONE;
+}
+
+
+static size_t
+collect(TGADecoder  *dec,
+	tbyte	    *dst,
+	const tbyte *bytes,
+	size_t	     len)
+{
+	size_t n = dec->need < len ? dec->need : len;
+	if (dst) {
+		memcpy(dst + dec->fill, bytes, n);
+	}
+	dec->fill += n;
+	dec->need -= n;
+	return n;
+}
+
+
+static void
+start_pixels(TGADecoder *dec)
+{
+	TGA *tga = &dec->tga;
+
+	if (!TGA_IMGTYPE_AVAILABLE(tga) ||
+	    tga->hdr.width == 0 || tga->hdr.height == 0) {
+		if (dec->data) {
+			dec->data->flags &= ~TGA_IMAGE_DATA;
+		}
+		dec->state = DEC_DONE;
+		return;
+	}
+
+	dec->kernel = __TGASelectKernel(tga->hdr.depth,
+		dec->data ? dec->data->flags : 0);
+	if (!dec->kernel) {
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return;
+	}
+
+	dec->sample_bytes = dec->kernel->sample_bytes;
+	dec->line_size = tga->hdr.width * dec->sample_bytes;
+	dec->out_size = tga->hdr.width * dec->kernel->out_bytes;
+
+	tuint64 alloc = dec->line_size + dec->out_size;
+	if (WANT(dec, TGA_IMAGE_DATA)) {
+		alloc += (tuint64) dec->out_size * tga->hdr.height;
+	}
+	if (__TGACheckLimits(tga, __TGAMinFileSize(tga, 1), alloc) != TGA_OK) {
+		if (dec->data) {
+			dec->data->flags &= ~TGA_IMAGE_DATA;
+		}
+		return;
+	}
+
+	dec->line = (tbyte*) malloc(dec->line_size);
+	dec->out = dec->line;
+	if (dec->out_size != dec->line_size) {
+		dec->out = (tbyte*) malloc(dec->out_size);
+	}
+	if (!dec->line || !dec->out) {
+		TGA_ERROR(tga, TGA_OOM);
+		return;
+	}
+
+	if (WANT(dec, TGA_IMAGE_DATA)) {
+		if (!TGA_SIZE_OK((tuint64) dec->out_size * tga->hdr.height) ||
+		    !__TGAReserve(dec->data, &dec->data->img_data,
+				&dec->data->img_data_size,
+				dec->out_size * tga->hdr.height)) {
+			dec->data->flags &= ~TGA_IMAGE_DATA;
+			TGA_ERROR(tga, TGA_OOM);
+			return;
+		}
+	}
+
+	if (WANT(dec, TGA_STATS) && dec->data->stats) {
+		__TGAStatsBegin(&dec->stats, dec->data->stats,
+			dec->out_size / tga->hdr.width,
+			tga->hdr.depth == 32 && TGA_IMGTYPE_IS_TRUEC(tga));
+	}
+
+	dec->state = TGA_IMGTYPE_IS_ENCODED(tga) ? DEC_PACKET_HEAD : DEC_PIXELS;
+	dec->need = dec->line_size;
+}
+
+
+static void
+start_color_map(TGADecoder *dec)
+{
+	TGA *tga = &dec->tga;
+
+	dec->state = DEC_COLOR_MAP;
+	dec->fill = 0;
+	dec->need = TGA_CMAP_SIZE(tga);
+	if (dec->need == 0) {
+		if (dec->data) {
+			dec->data->flags &= ~TGA_COLOR_MAP;
+		}
+		start_pixels(dec);
+		return;
+	}
+
+	if (WANT(dec, TGA_IMAGE_DATA)) {
+		const TGAKernel *k = __TGASelectKernel(tga->hdr.map_entry,
+			dec->data->flags);
+		size_t size = dec->need;
+		if (k) {
+			size = size / k->sample_bytes * k->out_bytes;
+		}
+		if (!__TGAReserve(dec->data, &dec->data->cmap,
+				&dec->data->cmap_size, size)) {
+			dec->data->flags &= ~TGA_COLOR_MAP;
+			TGA_ERROR(tga, TGA_OOM);
+		}
+	}
+}
+
+
+static void
+finish_color_map(TGADecoder *dec)
+{
+	TGA *tga = &dec->tga;
+	TGAData *data = dec->data;
+
+	if (WANT(dec, TGA_IMAGE_DATA)) {
+		const TGAKernel *k = __TGASelectKernel(tga->hdr.map_entry,
+			data->flags);
+		if (k && k->convert) {
+			k->convert(data->cmap, data->cmap,
+				TGA_CMAP_SIZE(tga) / k->sample_bytes);
+		}
+		data->flags |= TGA_COLOR_MAP;
+	}
+	TGA_TRACE_EVENT(COLOR_MAP, tga, 0, 0, 0, TGA_CMAP_SIZE(tga));
+	start_pixels(dec);
+}
+
+
+static void
+start_image_id(TGADecoder *dec)
+{
+	TGA *tga = &dec->tga;
+	TGAData *data = dec->data;
+
+	dec->state = DEC_IMAGE_ID;
+	dec->fill = 0;
+	dec->need = tga->hdr.id_len;
+	if (dec->need == 0) {
+		if (data) {
+			data->flags &= ~TGA_IMAGE_ID;
+		}
+		start_color_map(dec);
+		return;
+	}
+
+	if (WANT(dec, TGA_IMAGE_ID)) {
+		if (!__TGAReserve(data, &data->img_id, &data->img_id_size,
+				  dec->need)) {
+			data->flags &= ~TGA_IMAGE_ID;
+			TGA_ERROR(tga, TGA_OOM);
+		}
+	}
+}
+
+
+static void
+emit_line(TGADecoder *dec)
+{
+	TGA *tga = &dec->tga;
+	TGAData *data = dec->data;
+
+	if (dec->kernel->convert) {
+		dec->kernel->convert(dec->line, dec->out, tga->hdr.width);
+	}
+
+	if (WANT(dec, TGA_IMAGE_DATA)) {
+		memcpy(data->img_data + (size_t) dec->row * dec->out_size,
+			dec->out, dec->out_size);
+	}
+	if (WANT(dec, TGA_STATS) && data->stats) {
+		__TGAStatsUpdate(&dec->stats, dec->out, dec->out_size);
+	}
+	if (dec->proc) {
+		dec->proc(dec, dec->row, dec->out, dec->user);
+	}
+
+	dec->line_fill = 0;
+	if (++dec->row == tga->hdr.height) {
+		if (WANT(dec, TGA_STATS) && data->stats) {
+			__TGAStatsEnd(&dec->stats);
+		}
+		dec->state = DEC_DONE;
+	}
+}
+
+
+/* Store the pending run into the scanline. Runs may cross scanlines. */
+static void
+put_run(TGADecoder *dec)
+{
+	while (dec->run && dec->state != DEC_DONE) {
+		memcpy(dec->line + dec->line_fill, dec->sample, dec->sample_bytes);
+		dec->line_fill += dec->sample_bytes;
+		--dec->run;
+		if (dec->line_fill == dec->line_size) {
+			emit_line(dec);
+		}
+	}
+	if (dec->state != DEC_DONE) {
+		dec->state = DEC_PACKET_HEAD;
+	}
+}
+
+
+static size_t
+feed_pixels(TGADecoder  *dec,
+	    const tbyte *bytes,
+	    size_t	 len)
+{
+	size_t n = dec->line_size - dec->line_fill;
+	if (n > dec->need) n = dec->need;
+	if (n > len) n = len;
+
+	memcpy(dec->line + dec->line_fill, bytes, n);
+	dec->line_fill += n;
+	dec->need -= n;
+	if (dec->line_fill == dec->line_size) {
+		emit_line(dec);
+	}
+	if (dec->state == DEC_PIXELS && dec->need == 0) {
+		dec->need = dec->line_size;
+	} else if (dec->state == DEC_RAW_SAMPLES && dec->need == 0) {
+		dec->state = DEC_PACKET_HEAD;
+	}
+	return n;
+}
+
+
+static size_t
+feed_packet_head(TGADecoder  *dec,
+		 const tbyte *bytes)
+{
+	tbyte packet_head = bytes[0];
+	if (packet_head & 0x80) {
+		dec->run = 1 + (packet_head & 0x7f);
+		dec->fill = 0;
+		dec->need = dec->sample_bytes;
+		dec->state = DEC_RUN_SAMPLE;
+	} else {
+		dec->need = (1 + packet_head) * dec->sample_bytes;
+		dec->state = DEC_RAW_SAMPLES;
+	}
+	return 1;
+}
+
+
+int
+TGADecoderFeed(TGADecoder  *dec,
+	       const tbyte *bytes,
+	       size_t	    len)
+{
+	if (!dec) return TGA_ERROR;
+
+	TGA *tga = &dec->tga;
+	if (!bytes && len) {
+		TGA_ERROR(tga, TGA_ERROR);
+	}
+
+	/* the scanlines completed by this call are traced as one band */
+	const tshort first_row = dec->row;
+	tuint64 pixel_bytes = 0;
+
+	while (len > 0 && dec->state != DEC_DONE && __TGA_SUCCEEDED(tga)) {
+		const int pixels = dec->state >= DEC_PIXELS;
+		size_t used = 0;
+		switch (dec->state) {
+		case DEC_HEADER:
+			dec->need = TGA_HEADER_SIZE - dec->fill;
+			used = collect(dec, dec->hdr, bytes, len);
+			if (dec->fill == TGA_HEADER_SIZE) {
+				__TGAParseHeader(tga, dec->hdr);
+				if (!__TGA_SUCCEEDED(tga)) {
+					if (dec->data) {
+						dec->data->flags &= ~TGA_IMAGE_INFO;
+					}
+					break;
+				}
+				if (dec->data) {
+					dec->data->flags |= TGA_IMAGE_INFO;
+				}
+				TGA_TRACE_EVENT(HEADER, tga, 0, 0, 0,
+					TGA_HEADER_SIZE);
+				start_image_id(dec);
+			}
+			break;
+		case DEC_IMAGE_ID:
+			used = collect(dec, WANT(dec, TGA_IMAGE_ID) ?
+				dec->data->img_id : NULL, bytes, len);
+			if (dec->need == 0) {
+				if (WANT(dec, TGA_IMAGE_ID)) {
+					dec->data->flags |= TGA_IMAGE_ID;
+				}
+				TGA_TRACE_EVENT(IMAGE_ID, tga, 0, 0, 0,
+					tga->hdr.id_len);
+				start_color_map(dec);
+			}
+			break;
+		case DEC_COLOR_MAP:
+			used = collect(dec, WANT(dec, TGA_IMAGE_DATA) ?
+				dec->data->cmap : NULL, bytes, len);
+			if (dec->need == 0) {
+				finish_color_map(dec);
+			}
+			break;
+		case DEC_PIXELS:
+		case DEC_RAW_SAMPLES:
+			used = feed_pixels(dec, bytes, len);
+			break;
+		case DEC_PACKET_HEAD:
+			used = feed_packet_head(dec, bytes);
+			break;
+		case DEC_RUN_SAMPLE:
+			used = collect(dec, dec->sample, bytes, len);
+			if (dec->need == 0) {
+				put_run(dec);
+			}
+			break;
+		}
+		if (pixels) {
+			pixel_bytes += used;
+		}
+		bytes += used;
+		len -= used;
+	}
+
+	if (dec->row != first_row) {
+		const tuint32 rows = dec->row - first_row;
+		TGA_TRACE_EVENT(ROWS, tga, 0, first_row, rows, pixel_bytes);
+		if (dec->kernel->convert) {
+			TGA_TRACE_EVENT(CONVERT, tga, 0, first_row, rows,
+				(tuint64) rows * dec->out_size);
+		}
+	}
+	return __TGA_LASTERR(tga);
+}
@@ -0,0 +1,432 @@
+/*
+ *  tgadiff.c - Comparison of two images with per-channel tolerance
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* sysconf */
+#define _POSIX_C_SOURCE 200112L
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tga.h>
+#include "tga_private.h"
+
+#define MAX_THREADS	64
+/* decoded bytes per image and band */
+#define BAND_BYTES	(256 * 1024)
+/* samples whose squared errors fit a 32 bit sum */
+#define SQ_CHUNK	65536
+
+/*
+ * Both images are decoded a band of rows at a time with TGAReadRegionAt,
+ * bands are handed out to the threads in order. Rows are first compared
+ * with memcmp; only rows that differ go through the per-sample loop,
+ * which is kept free of branches and cross-sample dependencies so that
+ * it vectorizes.
+ */
+
+typedef struct _DiffCtx {
+	const TGA	*img[2];
+	const tbyte	*cmap[2];	/* 256 expanded entries, or NULL */
+	size_t		 channels;
+	size_t		 row_bytes;	/* of a decoded region row */
+	size_t		 band_rows;
+	tbyte		*tol;		/* tolerance of every sample of a row */
+	TGADiff		*diff;
+	pthread_mutex_t	 lock;
+	tuint32		 next_band;
+	int		 stop;
+	tuint32		 stop_band;	/* bands from here on were skipped */
+	int		 err;
+	/* merged results */
+	tuint64		 mismatches;
+	tuint64		 sq;
+	tuint64		 first;		/* y * w + x of the first mismatch */
+} DiffCtx;
+
+typedef struct _DiffJob {
+	DiffCtx		*ctx;
+	tbyte		*buf[2];	/* a band of each image */
+	tbyte		*idx;		/* color map indices of a band */
+	tbyte		*over;		/* per sample, out of tolerance */
+	tbyte		*max;		/* per sample of a row, largest error */
+	tuint64		 mismatches;
+	tuint64		 sq;
+	tuint64		 first;
+} DiffJob;
+
+
+static int
+read_band(DiffCtx *ctx,
+	  DiffJob *job,
+	  int	   i,
+	  tuint32  y,
+	  tuint32  rows)
+{
+	const TGADiff *diff = ctx->diff;
+	if (!ctx->cmap[i]) {
+		return TGAReadRegionAt(ctx->img[i], job->buf[i], diff->x, y,
+			diff->w, rows, 0);
+	}
+
+	int err = TGAReadRegionAt(ctx->img[i], job->idx, diff->x, y, diff->w,
+		rows, 0);
+	const size_t ch = ctx->channels;
+	const size_t n = (size_t) diff->w * rows;
+	for (size_t p = 0; p < n && err == TGA_OK; ++p) {
+		memcpy(job->buf[i] + p * ch, ctx->cmap[i] + job->idx[p] * ch, ch);
+	}
+	return err;
+}
+
+
+static void
+compare_row(DiffCtx	*ctx,
+	    DiffJob	*job,
+	    const tbyte *a,
+	    const tbyte *b,
+	    tuint32	 y)
+{
+	const TGADiff *diff = ctx->diff;
+	const size_t w = diff->w;
+	const size_t ch = ctx->channels;
+	const size_t n = ctx->row_bytes;
+	tbyte *mask = diff->mask ? diff->mask + (size_t) (y - diff->y) * w : NULL;
+
+	if (!memcmp(a, b, n)) {
+		if (mask) {
+			memset(mask, 0, w);
+		}
+		return;
+	}
+
+	const tbyte *tol = ctx->tol;
+	tbyte *over = job->over;
+	tbyte *max = job->max;
+	tbyte any = 0;
+	for (size_t i0 = 0; i0 < n; i0 += SQ_CHUNK) {
+		const size_t end = i0 + SQ_CHUNK < n ? i0 + SQ_CHUNK : n;
+		tuint32 sq = 0;
+		for (size_t i = i0; i < end; ++i) {
+			const tbyte d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+			const tbyte o = d > tol[i];
+			sq += (tuint32) d * d;
+			max[i] = d > max[i] ? d : max[i];
+			over[i] = o;
+			any |= o;
+		}
+		job->sq += sq;
+	}
+
+	if (!any) {
+		if (mask) {
+			memset(mask, 0, w);
+		}
+		return;
+	}
+	for (size_t x = 0; x < w; ++x) {
+		tbyte o = 0;
+		for (size_t c = 0; c < ch; ++c) {
+			o |= over[x * ch + c];
+		}
+		if (o) {
+			const tuint64 at = (tuint64) (y - diff->y) * w + x;
+			if (at < job->first) {
+				job->first = at;
+			}
+			job->mismatches += 1;
+		}
+		if (mask) {
+			mask[x] = o ? 255 : 0;
+		}
+	}
+}
+
+
+static void *
+diff_main(void *arg)
+{
+	DiffJob *job = (DiffJob*) arg;
+	DiffCtx *ctx = job->ctx;
+	const TGADiff *diff = ctx->diff;
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		const int done = ctx->stop || ctx->err != TGA_OK;
+		const tuint32 band = ctx->next_band++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		const tuint64 y0 = (tuint64) band * ctx->band_rows;
+		if (done || y0 >= diff->h) {
+			break;
+		}
+		const tuint32 y = diff->y + y0;
+		const tuint32 rows = diff->h - y0 < ctx->band_rows ?
+			diff->h - y0 : ctx->band_rows;
+
+		int err = read_band(ctx, job, 0, y, rows);
+		if (err == TGA_OK) {
+			err = read_band(ctx, job, 1, y, rows);
+		}
+		if (err != TGA_OK) {
+			pthread_mutex_lock(&ctx->lock);
+			if (ctx->err == TGA_OK) {
+				ctx->err = err;
+			}
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		for (tuint32 r = 0; r < rows; ++r) {
+			compare_row(ctx, job, job->buf[0] + r * ctx->row_bytes,
+				job->buf[1] + r * ctx->row_bytes, y + r);
+		}
+		if (diff->first_only && job->mismatches) {
+			pthread_mutex_lock(&ctx->lock);
+			if (!ctx->stop) {
+				ctx->stop = 1;
+				ctx->stop_band = ctx->next_band;
+			}
+			pthread_mutex_unlock(&ctx->lock);
+		}
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->mismatches += job->mismatches;
+	ctx->sq += job->sq;
+	if (job->first < ctx->first) {
+		ctx->first = job->first;
+	}
+	for (size_t i = 0; i < ctx->row_bytes; ++i) {
+		tbyte *m = &ctx->diff->max_error[i % ctx->channels];
+		if (job->max[i] > *m) {
+			*m = job->max[i];
+		}
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+
+/* The color map of a mapped image as 256 decoded entries, unused ones 0. */
+static tbyte *
+expand_cmap(TGA	   *tga,
+	    size_t  channels,
+	    int	   *err)
+{
+	const TGAKernel *k = __TGASelectKernel(tga->hdr.map_entry, 0);
+	if (!k || k->out_bytes != channels) {
+		*err = k ? TGA_ERROR : TGA_UNKNOWN_SUB_FORMAT;
+		return NULL;
+	}
+
+	TGAData data;
+	memset(&data, 0, sizeof(data));
+	tbyte *cmap = (tbyte*) calloc(256, channels);
+	if (!cmap) {
+		*err = TGA_OOM;
+		return NULL;
+	}
+	TGAReadColorMap(tga, &data);
+	*err = __TGA_LASTERR(tga);
+	if (*err == TGA_OK && data.cmap) {
+		const size_t first = tga->hdr.map_first;
+		for (size_t e = 0; e < tga->hdr.map_len && first + e < 256; ++e) {
+			memcpy(cmap + (first + e) * channels,
+				data.cmap + e * channels, channels);
+		}
+	}
+	TGAFreeTGAData(&data);
+	if (*err != TGA_OK) {
+		free(cmap);
+		return NULL;
+	}
+	return cmap;
+}
+
+
+/* Decoded bytes per pixel, with color maps expanded. */
+static size_t
+decoded_channels(const TGA *tga)
+{
+	const TGAKernel *k = __TGASelectKernel(TGA_IMGTYPE_IS_MAPPED(tga) ?
+		tga->hdr.map_entry : tga->hdr.depth, 0);
+	return k ? k->out_bytes : 0;
+}
+
+
+int
+TGADiffImages(TGA     *a,
+	      TGA     *b,
+	      TGADiff *diff)
+{
+	if (!a || !b || !diff) return TGA_ERROR;
+
+	TGA *img[2] = { a, b };
+	for (int i = 0; i < 2; ++i) {
+		if (!TGA_IMGTYPE_AVAILABLE(img[i]) || !img[i]->seekable) {
+			TGA_ERROR(img[i], TGA_ERROR);
+			return __TGA_LASTERR(img[i]);
+		}
+	}
+	const size_t channels = decoded_channels(a);
+	if (channels == 0) {
+		TGA_ERROR(a, TGA_UNKNOWN_SUB_FORMAT);
+		return __TGA_LASTERR(a);
+	}
+	if (channels != decoded_channels(b) ||
+	    a->hdr.width != b->hdr.width || a->hdr.height != b->hdr.height) {
+		TGA_ERROR(b, TGA_ERROR);
+		return __TGA_LASTERR(b);
+	}
+	if (diff->w == 0 || diff->h == 0) {
+		diff->x = diff->y = 0;
+		diff->w = a->hdr.width;
+		diff->h = a->hdr.height;
+	}
+	if (diff->x > a->hdr.width || diff->w > a->hdr.width - diff->x ||
+	    diff->y > a->hdr.height || diff->h > a->hdr.height - diff->y) {
+		TGA_ERROR(a, TGA_ERROR);
+		return __TGA_LASTERR(a);
+	}
+
+	diff->mismatches = 0;
+	diff->first_x = diff->first_y = 0;
+	memset(diff->max_error, 0, sizeof(diff->max_error));
+	diff->psnr = HUGE_VAL;
+	if (diff->w == 0 || diff->h == 0) {
+		return TGA_OK;
+	}
+
+	DiffCtx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.diff = diff;
+	ctx.channels = channels;
+	ctx.row_bytes = (size_t) diff->w * channels;
+	ctx.band_rows = BAND_BYTES / ctx.row_bytes ? BAND_BYTES / ctx.row_bytes : 1;
+	ctx.first = (tuint64) -1;
+
+	int err = TGA_OK;
+	for (int i = 0; i < 2 && err == TGA_OK; ++i) {
+		ctx.img[i] = img[i];
+		if (TGA_IMGTYPE_IS_ENCODED(img[i]) && !img[i]->row_off) {
+			err = TGABuildRowIndex(img[i]);
+		}
+		if (err == TGA_OK && TGA_IMGTYPE_IS_MAPPED(img[i])) {
+			ctx.cmap[i] = expand_cmap(img[i], channels, &err);
+		}
+	}
+	const tuint64 band_bytes = (tuint64) ctx.band_rows * ctx.row_bytes;
+	if (err == TGA_OK && !TGA_SIZE_OK(band_bytes)) {
+		err = TGA_OOM;
+	}
+
+	tuint32 threads = diff->threads;
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > MAX_THREADS) threads = MAX_THREADS;
+	const tuint32 bands = (diff->h + ctx.band_rows - 1) / ctx.band_rows;
+	if (threads > bands) threads = bands;
+
+	DiffJob jobs[MAX_THREADS];
+	memset(jobs, 0, sizeof(jobs));
+	ctx.tol = (tbyte*) malloc(ctx.row_bytes);
+	if (err == TGA_OK && !ctx.tol) {
+		err = TGA_OOM;
+	}
+	for (tuint32 t = 0; t < threads && err == TGA_OK; ++t) {
+		DiffJob *job = &jobs[t];
+		job->ctx = &ctx;
+		job->first = (tuint64) -1;
+		job->buf[0] = (tbyte*) malloc(band_bytes);
+		job->buf[1] = (tbyte*) malloc(band_bytes);
+		job->over = (tbyte*) malloc(ctx.row_bytes);
+		job->max = (tbyte*) calloc(ctx.row_bytes, 1);
+		if (ctx.cmap[0] || ctx.cmap[1]) {
+			job->idx = (tbyte*) malloc((size_t) ctx.band_rows * diff->w);
+		}
+		if (!job->buf[0] || !job->buf[1] || !job->over || !job->max ||
+		    ((ctx.cmap[0] || ctx.cmap[1]) && !job->idx)) {
+			err = TGA_OOM;
+		}
+	}
+
+	if (err == TGA_OK && pthread_mutex_init(&ctx.lock, NULL)) {
+		err = TGA_ERROR;
+	}
+	if (err == TGA_OK) {
+		for (size_t i = 0; i < ctx.row_bytes; ++i) {
+			ctx.tol[i] = diff->tolerance[i % channels];
+		}
+
+		pthread_t tid[MAX_THREADS];
+		int started[MAX_THREADS];
+		for (tuint32 t = 1; t < threads; ++t) {
+			started[t] = !pthread_create(&tid[t], NULL, diff_main,
+				&jobs[t]);
+		}
+		diff_main(&jobs[0]);
+		for (tuint32 t = 1; t < threads; ++t) {
+			if (started[t]) {
+				pthread_join(tid[t], NULL);
+			} else {
+				diff_main(&jobs[t]);
+			}
+		}
+		pthread_mutex_destroy(&ctx.lock);
+		err = ctx.err;
+
+		/* the bands first_only skipped differ nowhere as far as we know */
+		const tuint64 y0 = (tuint64) ctx.stop_band * ctx.band_rows;
+		if (err == TGA_OK && ctx.stop && diff->mask && y0 < diff->h) {
+			memset(diff->mask + y0 * diff->w, 0,
+				(size_t) (diff->h - y0) * diff->w);
+		}
+	}
+
+	for (tuint32 t = 0; t < threads; ++t) {
+		free(jobs[t].buf[0]);
+		free(jobs[t].buf[1]);
+		free(jobs[t].idx);
+		free(jobs[t].over);
+		free(jobs[t].max);
+	}
+	free(ctx.tol);
+	free((void*) ctx.cmap[0]);
+	free((void*) ctx.cmap[1]);
+	if (err != TGA_OK) {
+		TGA_ERROR(a, err);
+		return __TGA_LASTERR(a);
+	}
+
+	diff->mismatches = ctx.mismatches;
+	if (ctx.mismatches) {
+		diff->first_x = diff->x + ctx.first % diff->w;
+		diff->first_y = diff->y + ctx.first / diff->w;
+	}
+	if (ctx.sq) {
+		const double samples = (double) diff->w * diff->h * channels;
+		diff->psnr = 10.0 * log10(255.0 * 255.0 * samples / ctx.sq);
+	}
+	return TGA_OK;
+}
@@ -0,0 +1,377 @@
+/*
+ *  tgakernel.c - Per image scanline kernels
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tga.h>
+#include "tga_private.h"
+
+/*
+ * The generic loops below take the sample size as an argument and are
+ * only ever called with a constant, so every wrapper gets its own copy
+ * with fixed strides and fixed size memcpy/memcmp.
+ */
+
+static inline int
+read_rle(TGA	      *tga,
+	 tbyte	      *buf,
+	 const size_t  sb)
+{
+	const size_t width = tga->hdr.width;
+	for (size_t x = 0; x < width;) {
+		tbyte packet_head;
+		if (TGARead(tga, &packet_head, 1, 1) != 1) {
+			return __TGA_LASTERR(tga);
+		}
+		size_t n = 1 + (packet_head & 0x7f);
+		if (x + n > width) { //FIXME: TGA v1 does allow cross scanline RLE
+			TGA_ERROR(tga, TGA_ERROR);
+			return __TGA_LASTERR(tga);
+		}
+
+		tbyte *dst = buf + x * sb;
+		if (packet_head & 0x80) {
+			if (TGARead(tga, dst, sb, 1) != 1) {
+				return __TGA_LASTERR(tga);
+			}
+			for (size_t i = 1; i < n; ++i) {
+				memcpy(dst + i * sb, dst, sb);
+			}
+		} else if (TGARead(tga, dst, sb, n) != n) {
+			return __TGA_LASTERR(tga);
+		}
+		x += n;
+	}
+	return __TGA_LASTERR(tga);
+}
+
+
+/*
+ * RLE packetizer. Packets go to out; if tga is given, out holds cap
+ * bytes and is flushed through TGAWrite whenever the next packet might
+ * not fit, otherwise out must hold width * (sb + 1) bytes. Returns the
+ * bytes left in out.
+ */
+#define PUT_PACKET(head, src, count) \
+	do { \
+		if (tga && fill + 1 + (count) * sb > cap) { \
+			TGAWrite(tga, out, fill, 1); \
+			fill = 0; \
+		} \
+		out[fill++] = (head); \
+		memcpy(out + fill, (src), (count) * sb); \
+		fill += (count) * sb; \
+	} while (0)
+
+static inline size_t
+encode_rle(TGA		*tga,
+	   const tbyte	*buf,
+	   size_t	 width,
+	   tbyte	*out,
+	   size_t	 cap,
+	   const size_t	 sb)
+{
+	size_t fill = 0;
+	tuint8 repetition = 0;
+	tuint8 raw = 0;
+
+	const tbyte *sample_start = buf;
+
+	for (size_t x = 1; x < width; ++x) {
+		if (memcmp(buf, buf + sb, sb)) {
+			if (repetition) {
+				PUT_PACKET(repetition | 0x80, sample_start, 1);
+				sample_start = buf + sb;
+				repetition = 0;
+				raw = 0;
+			} else {
+				raw += 1;
+			}
+		} else {
+			if (raw) {
+				PUT_PACKET((raw - 1) | 0x00, sample_start, raw);
+				sample_start = buf;
+				raw = 0;
+				repetition = 1;
+			} else {
+				repetition += 1;
+			}
+		}
+		if (repetition == 0x80) {
+			PUT_PACKET(255, sample_start, 1);
+			sample_start = buf + sb;
+			raw = 0;
+			repetition = 0;
+		} else if (raw == 128) {
+			PUT_PACKET(127, sample_start, raw);
+			sample_start = buf + sb;
+			raw = 0;
+			repetition = 0;
+		}
+		buf += sb;
+	}
+
+	if (repetition > 0) {
+		PUT_PACKET(repetition | 0x80, sample_start, 1);
+	} else {
+		PUT_PACKET(raw | 0x00, sample_start, raw + 1);
+	}
+	return fill;
+}
+
+
+/*
+ * Packetizer for the fewest bytes, with TGA_RLE_OPTIMAL. best[i] is the
+ * size of samples i..width-1 packed optimally, found right to left: a
+ * run packet at i is best as long as the run allows, since best only
+ * shrinks toward the end; raw packets cost best[j] + j * sb + 1 - i * sb
+ * for the j they end at, minimized over the 128 candidates with a
+ * monotonic queue. how[i] is the packet taken at i. Same interface as
+ * encode_rle, the tables live in tmp.
+ */
+#define OPTIMAL_TMP_SIZE(width) (((width) + 1) * (2 * sizeof(tuint32) + 1))
+
+static inline size_t
+encode_rle_optimal(TGA		*tga,
+		   const tbyte	*buf,
+		   size_t	 width,
+		   tbyte	*out,
+		   size_t	 cap,
+		   void		*tmp,
+		   const size_t	 sb)
+{
+	tuint32 *best = (tuint32*) tmp;
+	tuint32 *queue = best + width + 1;
+	tbyte *how = (tbyte*) (queue + width + 1);
+	size_t head = 0;
+	size_t tail = 0;
+	size_t run = 0;
+
+	best[width] = 0;
+	for (size_t i = width; i-- > 0;) {
+		const size_t j = i + 1;
+		const tuint32 cost = best[j] + j * sb;
+		while (tail > head && best[queue[tail - 1]] +
+		       queue[tail - 1] * sb > cost) {
+			--tail;
+		}
+		queue[tail++] = j;
+		if (queue[head] > i + 128) {
+			++head;
+		}
+		const size_t end = queue[head];
+		best[i] = best[end] + end * sb + 1 - i * sb;
+		how[i] = end - i - 1;
+
+		run = j < width && !memcmp(buf + i * sb, buf + j * sb, sb) ?
+			run + 1 : 1;
+		const size_t n = run < 128 ? run : 128;
+		if (best[i + n] + 1 + sb <= best[i]) {
+			best[i] = best[i + n] + 1 + sb;
+			how[i] = 0x80 | (n - 1);
+		}
+	}
+
+	size_t fill = 0;
+	for (size_t i = 0; i < width;) {
+		const size_t n = (how[i] & 0x7f) + 1;
+		PUT_PACKET(how[i], buf + i * sb, how[i] & 0x80 ? 1 : n);
+		i += n;
+	}
+	return fill;
+}
+
+
+void *
+__TGARLETmp(TGA *tga)
+{
+	const size_t size = OPTIMAL_TMP_SIZE((size_t) tga->hdr.width);
+	if (tga->rle_tmp_size < size) {
+		tbyte *tmp = (tbyte*) realloc(tga->rle_tmp, size);
+		if (!tmp) {
+			return NULL;
+		}
+		tga->rle_tmp = tmp;
+		tga->rle_tmp_size = size;
+	}
+	return tga->rle_tmp;
+}
+
+
+static inline int
+write_rle(TGA	       *tga,
+	  tbyte	       *buf,
+	  const size_t	sb)
+{
+	tbyte out[4096];
+	size_t fill = encode_rle(tga, buf, tga->hdr.width, out, sizeof(out), sb);
+	TGAWrite(tga, out, fill, 1);
+	return __TGA_LASTERR(tga);
+}
+
+
+static inline int
+write_rle_optimal(TGA	       *tga,
+		  tbyte	       *buf,
+		  const size_t	sb)
+{
+	tbyte out[4096];
+	void *tmp = __TGARLETmp(tga);
+	if (!tmp) {
+		TGA_ERROR(tga, TGA_OOM);
+		return __TGA_LASTERR(tga);
+	}
+	size_t fill = encode_rle_optimal(tga, buf, tga->hdr.width, out,
+		sizeof(out), tmp, sb);
+	TGAWrite(tga, out, fill, 1);
+	return __TGA_LASTERR(tga);
+}
+
+
+static inline void
+swap(const tbyte  *src,
+     tbyte	  *dst,
+     size_t	   n,
+     const size_t  sb)
+{
+	for (size_t i = 0; i < n; ++i, src += sb, dst += sb) {
+		tbyte b = src[0];
+		if (dst != src) {
+			memcpy(dst, src, sb);
+		}
+		dst[0] = src[2];
+		dst[2] = b;
+	}
+}
+
+
+/* back to front, so dst may overlay src as long as dst >= src */
+static void
+unpack16(const tbyte *src,
+	 tbyte	     *dst,
+	 size_t	      n)
+{
+	for (size_t i = n; i-- > 0;) {
+		__TGAunpack16(src + i * 2, dst + i * 3);
+	}
+}
+
+
+static int read_rle1(TGA *tga, tbyte *buf) { return read_rle(tga, buf, 1); }
+static int read_rle2(TGA *tga, tbyte *buf) { return read_rle(tga, buf, 2); }
+static int read_rle3(TGA *tga, tbyte *buf) { return read_rle(tga, buf, 3); }
+static int read_rle4(TGA *tga, tbyte *buf) { return read_rle(tga, buf, 4); }
+
+static int write_rle1(TGA *tga, tbyte *buf) { return write_rle(tga, buf, 1); }
+static int write_rle2(TGA *tga, tbyte *buf) { return write_rle(tga, buf, 2); }
+static int write_rle3(TGA *tga, tbyte *buf) { return write_rle(tga, buf, 3); }
+static int write_rle4(TGA *tga, tbyte *buf) { return write_rle(tga, buf, 4); }
+
+static size_t encode_rle1(const tbyte *buf, size_t width, tbyte *out, void *tmp)
+{ (void) tmp; return encode_rle(NULL, buf, width, out, 0, 1); }
+static size_t encode_rle2(const tbyte *buf, size_t width, tbyte *out, void *tmp)
+{ (void) tmp; return encode_rle(NULL, buf, width, out, 0, 2); }
+static size_t encode_rle3(const tbyte *buf, size_t width, tbyte *out, void *tmp)
+{ (void) tmp; return encode_rle(NULL, buf, width, out, 0, 3); }
+static size_t encode_rle4(const tbyte *buf, size_t width, tbyte *out, void *tmp)
+{ (void) tmp; return encode_rle(NULL, buf, width, out, 0, 4); }
+
+static int write_rle_optimal1(TGA *tga, tbyte *buf) { return write_rle_optimal(tga, buf, 1); }
+static int write_rle_optimal2(TGA *tga, tbyte *buf) { return write_rle_optimal(tga, buf, 2); }
+static int write_rle_optimal3(TGA *tga, tbyte *buf) { return write_rle_optimal(tga, buf, 3); }
+static int write_rle_optimal4(TGA *tga, tbyte *buf) { return write_rle_optimal(tga, buf, 4); }
+
+static size_t encode_rle_optimal1(const tbyte *buf, size_t width, tbyte *out, void *tmp)
+{ return encode_rle_optimal(NULL, buf, width, out, 0, tmp, 1); }
+static size_t encode_rle_optimal2(const tbyte *buf, size_t width, tbyte *out, void *tmp)
+{ return encode_rle_optimal(NULL, buf, width, out, 0, tmp, 2); }
+static size_t encode_rle_optimal3(const tbyte *buf, size_t width, tbyte *out, void *tmp)
+{ return encode_rle_optimal(NULL, buf, width, out, 0, tmp, 3); }
+static size_t encode_rle_optimal4(const tbyte *buf, size_t width, tbyte *out, void *tmp)
+{ return encode_rle_optimal(NULL, buf, width, out, 0, tmp, 4); }
+
+static void swap3(const tbyte *src, tbyte *dst, size_t n) { swap(src, dst, n, 3); }
+static void swap4(const tbyte *src, tbyte *dst, size_t n) { swap(src, dst, n, 4); }
+
+
+static const TGAKernel kernels[] = {
+	/* read_rle	write_rle	encode_rle	swap	convert	  sample out */
+	{ read_rle1,	write_rle1,	encode_rle1,	NULL,	NULL,	  1,	 1 },
+	{ read_rle2,	write_rle2,	encode_rle2,	NULL,	unpack16, 2,	 3 },
+	{ read_rle3,	write_rle3,	encode_rle3,	NULL,	NULL,	  3,	 3 },
+	{ read_rle3,	write_rle3,	encode_rle3,	swap3,	swap3,	  3,	 3 },
+	{ read_rle4,	write_rle4,	encode_rle4,	NULL,	NULL,	  4,	 4 },
+	{ read_rle4,	write_rle4,	encode_rle4,	swap4,	swap4,	  4,	 4 },
+};
+
+/* the same with TGA_RLE_OPTIMAL */
+static const TGAKernel optimal_kernels[] = {
+	{ read_rle1, write_rle_optimal1, encode_rle_optimal1, NULL,  NULL,     1, 1 },
+	{ read_rle2, write_rle_optimal2, encode_rle_optimal2, NULL,  unpack16, 2, 3 },
+	{ read_rle3, write_rle_optimal3, encode_rle_optimal3, NULL,  NULL,     3, 3 },
+	{ read_rle3, write_rle_optimal3, encode_rle_optimal3, swap3, swap3,    3, 3 },
+	{ read_rle4, write_rle_optimal4, encode_rle_optimal4, NULL,  NULL,     4, 4 },
+	{ read_rle4, write_rle_optimal4, encode_rle_optimal4, swap4, swap4,    4, 4 },
+};
+
+
+const TGAKernel *
+__TGASelectKernel(tbyte   depth,
+		  tuint32 flags)
+{
+	const int rgb = TGA_CAN_SWAP(depth) && (flags & TGA_RGB);
+	const TGAKernel *table = (flags & TGA_RLE_OPTIMAL) ?
+		optimal_kernels : kernels;
+	switch (TGA_PIXEL_SIZE(depth)) {
+	case 1: return &table[0];
+	case 2: return &table[1];
+	case 3: return &table[2 + rgb];
+	case 4: return &table[4 + rgb];
+	default: return NULL;
+	}
+}
+
+/* what __TGASelectKernel looks at */
+#define KERNEL_KEY(depth, flags) \
+	(((tuint32) (depth) << 16) | ((flags) & (TGA_RGB | TGA_RLE_OPTIMAL)))
+
+const TGAKernel *
+__TGAKernel(TGA	    *tga,
+	    tuint32  flags)
+{
+	const tuint32 key = KERNEL_KEY(tga->hdr.depth, flags);
+	if (!tga->kernel || tga->kernel_key != key) {
+		tga->kernel = __TGASelectKernel(tga->hdr.depth, flags);
+		tga->kernel_key = key;
+	}
+	return tga->kernel;
+}
+
+
+const TGAKernel *
+__TGACachedKernel(const TGA *tga,
+		  tuint32    flags)
+{
+	if (tga->kernel && tga->kernel_key == KERNEL_KEY(tga->hdr.depth, flags)) {
+		return tga->kernel;
+	}
+	return __TGASelectKernel(tga->hdr.depth, flags);
+}
@@ -0,0 +1,314 @@
+/*
+ *  tgalazy.c - Images decoded a row at a time, on first access
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tga.h>
+#include "tga_private.h"
+
+#define WINDOW_CHUNK	65536
+
+struct _TGALazy {
+	TGA		*tga;
+	const TGAKernel	*kernel;
+	int		 fd;
+	size_t		 sln_size;	/* file bytes of a raw scanline */
+	size_t		 out_size;	/* bytes of a decoded row */
+	tbyte		*line;		/* scanline before conversion */
+
+	/* RLE images: row_off[0..known] are known, the rest is found by
+	 * walking the packets; the window holds file bytes from
+	 * window_off on */
+	tuint64		*row_off;
+	tuint32		 known;
+	int		 own_index;
+	tbyte		*window;
+	tuint64		 window_off;
+	size_t		 window_len;
+	size_t		 window_cap;
+	int		 window_eof;
+
+	/* decoded rows, least recently used one is replaced */
+	size_t		 n_slots;
+	tbyte		*rows;
+	tuint32		*slot_row;	/* height for an empty slot */
+	tuint64		*slot_used;
+	tuint32		*row_slot;	/* n_slots if not cached */
+	tuint64		 clock;
+};
+
+
+/* Bytes of the file available at off, refilling the window unless it
+ * already holds need bytes there. */
+static size_t
+window_at(TGALazy *lazy,
+	  tuint64  off,
+	  size_t   need,
+	  int	  *err)
+{
+	const tuint64 end = lazy->window_off + lazy->window_len;
+	if (off >= lazy->window_off && off <= end &&
+	    (off + need <= end || lazy->window_eof)) {
+		return end - off;
+	}
+
+	lazy->window_off = off;
+	lazy->window_len = 0;
+	lazy->window_eof = 0;
+	while (lazy->window_len < lazy->window_cap) {
+		ssize_t read = pread(lazy->fd, lazy->window + lazy->window_len,
+			lazy->window_cap - lazy->window_len,
+			off + lazy->window_len);
+		if (read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (read < 0) {
+			*err = TGA_READ_FAIL;
+			return 0;
+		}
+		if (read == 0) {
+			lazy->window_eof = 1;
+			break;
+		}
+		lazy->window_len += read;
+	}
+	return lazy->window_len;
+}
+
+
+/* Walk the packets up to the end of scanline y. */
+static int
+index_to(TGALazy *lazy,
+	 tuint32  y)
+{
+	const TGA *tga = lazy->tga;
+	const size_t sb = lazy->kernel->sample_bytes;
+	const size_t max_row = tga->hdr.width * (1 + sb);
+	int err = TGA_OK;
+
+	while (lazy->known <= y) {
+		const tuint64 off = lazy->row_off[lazy->known];
+		size_t avail = window_at(lazy, off, max_row, &err);
+		if (err != TGA_OK) {
+			return err;
+		}
+		size_t used = __TGADecodeRLE(lazy->window + (off - lazy->window_off),
+			avail, NULL, tga->hdr.width, sb);
+		if (!used) {
+			/* truncated, or packets cross scanlines */
+			return TGA_ERROR;
+		}
+		lazy->row_off[++lazy->known] = off + used;
+	}
+
+	/* complete now, TGAReadRowsAt can use it too */
+	if (lazy->known == tga->hdr.height && lazy->own_index &&
+	    !tga->row_off) {
+		lazy->tga->row_off = lazy->row_off;
+		lazy->own_index = 0;
+	}
+	return TGA_OK;
+}
+
+
+static int
+decode_row(TGALazy *lazy,
+	   tuint32  y,
+	   tbyte   *dst)
+{
+	const TGA *tga = lazy->tga;
+	const TGAKernel *k = lazy->kernel;
+	tbyte *line = k->convert ? lazy->line : dst;
+	int err = TGA_OK;
+
+	size_t len = lazy->sln_size;
+	if (!TGA_IMGTYPE_IS_ENCODED(tga)) {
+		err = __TGAPreadFull(lazy->fd, line, lazy->sln_size,
+			TGA_IMG_DATA_OFF(tga) + (tuint64) y * lazy->sln_size);
+	} else {
+		err = index_to(lazy, y);
+		if (err == TGA_OK) {
+			const tuint64 off = lazy->row_off[y];
+			len = lazy->row_off[y + 1] - off;
+			if (window_at(lazy, off, len, &err) < len && err == TGA_OK) {
+				err = TGA_READ_FAIL;
+			}
+			if (err == TGA_OK) {
+				__TGADecodeRLE(lazy->window + (off - lazy->window_off),
+					len, line, tga->hdr.width, k->sample_bytes);
+			}
+		}
+	}
+
+	if (err != TGA_OK) {
+		return err;
+	}
+	TGA_TRACE_EVENT(ROWS, tga, 0, y, 1, len);
+	if (k->convert) {
+		k->convert(line, dst, tga->hdr.width);
+		TGA_TRACE_EVENT(CONVERT, tga, 0, y, 1, lazy->out_size);
+	}
+	return TGA_OK;
+}
+
+
+TGALazy*
+TGALazyOpen(TGA	    *tga,
+	    tuint32  flags,
+	    size_t   cache_rows)
+{
+	if (!tga) return NULL;
+	if (!TGA_IMGTYPE_AVAILABLE(tga) || !tga->seekable ||
+	    tga->hdr.width == 0 || tga->hdr.height == 0) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return NULL;
+	}
+
+	const TGAKernel *k = __TGAKernel(tga, flags);
+	if (!k) {
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return NULL;
+	}
+
+	const size_t height = tga->hdr.height;
+	const size_t sln_size = TGA_SCANLINE_SIZE(tga);
+	const size_t out_size = (size_t) tga->hdr.width * k->out_bytes;
+	const int encoded = TGA_IMGTYPE_IS_ENCODED(tga);
+	const size_t window_cap = encoded ?
+		WINDOW_CHUNK + tga->hdr.width * (1 + k->sample_bytes) : 0;
+	if (cache_rows == 0) cache_rows = 1;
+	if (cache_rows > height) cache_rows = height;
+
+	const tuint64 alloc = sizeof(TGALazy) + sln_size + window_cap +
+		cache_rows * (out_size + sizeof(tuint32) + sizeof(tuint64)) +
+		height * (sizeof(tuint32) + (encoded ? sizeof(tuint64) : 0));
+	if (__TGACheckLimits(tga, __TGAMinFileSize(tga, 0), alloc) != TGA_OK) {
+		return NULL;
+	}
+
+	TGALazy *lazy = (TGALazy*) calloc(1, sizeof(TGALazy));
+	if (!lazy) {
+		TGA_ERROR(tga, TGA_OOM);
+		return NULL;
+	}
+	lazy->tga = tga;
+	lazy->kernel = k;
+	lazy->fd = fileno(tga->fd);
+	lazy->sln_size = sln_size;
+	lazy->out_size = out_size;
+	lazy->n_slots = cache_rows;
+	lazy->window_cap = window_cap;
+
+	lazy->line = (tbyte*) malloc(sln_size);
+	lazy->rows = (tbyte*) malloc(cache_rows * out_size);
+	lazy->slot_row = (tuint32*) malloc(cache_rows * sizeof(tuint32));
+	lazy->slot_used = (tuint64*) calloc(cache_rows, sizeof(tuint64));
+	lazy->row_slot = (tuint32*) malloc(height * sizeof(tuint32));
+	int ok = lazy->line && lazy->rows && lazy->slot_row &&
+		lazy->slot_used && lazy->row_slot;
+
+	if (ok && encoded) {
+		lazy->window = (tbyte*) malloc(window_cap);
+		ok = lazy->window != NULL;
+		if (tga->row_off) {
+			lazy->row_off = tga->row_off;
+			lazy->known = height;
+		} else {
+			lazy->row_off = (tuint64*) malloc((height + 1) *
+				sizeof(tuint64));
+			lazy->own_index = 1;
+			ok = ok && lazy->row_off;
+			if (lazy->row_off) {
+				lazy->row_off[0] = TGA_IMG_DATA_OFF(tga);
+			}
+		}
+	}
+	if (!ok) {
+		TGALazyClose(lazy);
+		TGA_ERROR(tga, TGA_OOM);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < cache_rows; ++i) {
+		lazy->slot_row[i] = height;
+	}
+	for (size_t y = 0; y < height; ++y) {
+		lazy->row_slot[y] = cache_rows;
+	}
+	return lazy;
+}
+
+
+int
+TGALazyRow(TGALazy	*lazy,
+	   tuint32	 y,
+	   const tbyte **row)
+{
+	if (!lazy || !row || y >= lazy->tga->hdr.height) return TGA_ERROR;
+	*row = NULL;
+
+	size_t slot = lazy->row_slot[y];
+	if (slot == lazy->n_slots) {
+		slot = 0;
+		for (size_t i = 1; i < lazy->n_slots; ++i) {
+			if (lazy->slot_used[i] < lazy->slot_used[slot]) {
+				slot = i;
+			}
+		}
+		if (lazy->slot_row[slot] < lazy->tga->hdr.height) {
+			lazy->row_slot[lazy->slot_row[slot]] = lazy->n_slots;
+			lazy->slot_row[slot] = lazy->tga->hdr.height;
+		}
+
+		int err = decode_row(lazy, y, lazy->rows + slot * lazy->out_size);
+		if (err != TGA_OK) {
+			return err;
+		}
+		lazy->slot_row[slot] = y;
+		lazy->row_slot[y] = slot;
+	}
+
+	lazy->slot_used[slot] = ++lazy->clock;
+	*row = lazy->rows + slot * lazy->out_size;
+	return TGA_OK;
+}
+
+
+void
+TGALazyClose(TGALazy *lazy)
+{
+	if (!lazy) return;
+
+	if (lazy->own_index) {
+		free(lazy->row_off);
+	}
+	free(lazy->window);
+	free(lazy->line);
+	free(lazy->rows);
+	free(lazy->slot_row);
+	free(lazy->slot_used);
+	free(lazy->row_slot);
+	free(lazy);
+}
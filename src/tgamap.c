@@ -0,0 +1,149 @@
+/*
+ *  tgamap.c - Zero-copy writer for uncompressed images via mmap(2)
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* mmap, msync, ftruncate, posix_fallocate */
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <tga.h>
+#include "tga_private.h"
+
+
+int
+TGAWriteMapped(TGA	*tga,
+	       TGAData	*data,
+	       tbyte   **pixels)
+{
+	if (!tga) return TGA_ERROR;
+	if (!data || !pixels) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+	*pixels = NULL;
+
+	if (TGAWriteUnmap(tga) != TGA_OK) {
+		return __TGA_LASTERR(tga);
+	}
+
+	const tuint64 cmap_size = TGA_CMAP_SIZE(tga);
+	if (!TGA_IMGTYPE_AVAILABLE(tga) ||
+	    ((data->flags & TGA_IMAGE_ID) && tga->hdr.id_len && !data->img_id) ||
+	    (cmap_size != 0 && !data->cmap)) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+	if (!__TGAKernel(tga, 0)) {
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return __TGA_LASTERR(tga);
+	}
+	if (!tga->seekable) {
+		TGA_ERROR(tga, TGA_SEEK_FAIL);
+		return __TGA_LASTERR(tga);
+	}
+
+	/* the pixels are raw, whatever the caller asked for */
+	tga->hdr.img_t &= ~0x8;
+	const tuint64 total = TGA_IMG_DATA_OFF(tga) + TGA_IMG_DATA_SIZE(tga);
+	if (!TGA_SIZE_OK(total)) {
+		TGA_ERROR(tga, TGA_TOO_LARGE);
+		return __TGA_LASTERR(tga);
+	}
+
+	/* memory streams have no descriptor to map */
+	int fd = fileno(tga->fd);
+	if (fd < 0 || fflush(tga->fd) || ftruncate(fd, (off_t) total)) {
+		TGA_ERROR(tga, TGA_WRITE_FAIL);
+		return __TGA_LASTERR(tga);
+	}
+	/* a sparse file raises SIGBUS on stores once the disk is full, so
+	 * reserve the blocks if asked to */
+	if (data->flags & TGA_PREALLOCATE) {
+		int r = posix_fallocate(fd, 0, (off_t) total);
+		if (r == ENOSPC || r == EFBIG) {
+			TGA_ERROR(tga, TGA_WRITE_FAIL);
+			return __TGA_LASTERR(tga);
+		}
+	}
+
+	/* fails with EACCES unless the file is open for reading as well */
+	void *map = mmap(NULL, (size_t) total, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		TGA_ERROR(tga, TGA_WRITE_FAIL);
+		return __TGA_LASTERR(tga);
+	}
+	tga->map = (tbyte*) map;
+	tga->map_size = total;
+
+	__TGAPackHeader(tga, tga->map);
+	TGA_TRACE_EVENT(HEADER, tga, 1, 0, 0, TGA_HEADER_SIZE);
+	if ((data->flags & TGA_IMAGE_ID) && tga->hdr.id_len) {
+		memcpy(tga->map + TGA_HEADER_SIZE, data->img_id, tga->hdr.id_len);
+		TGA_TRACE_EVENT(IMAGE_ID, tga, 1, 0, 0, tga->hdr.id_len);
+	}
+	if (cmap_size != 0) {
+		if (TGA_CAN_SWAP(tga->hdr.map_entry) && (data->flags & TGA_RGB)) {
+			__TGAbgr2rgb(data->cmap, cmap_size, tga->hdr.map_entry / 8);
+			data->flags &= ~TGA_RGB;
+		}
+		memcpy(tga->map + TGA_CMAP_OFF(tga), data->cmap, cmap_size);
+		data->flags |= TGA_COLOR_MAP;
+		TGA_TRACE_EVENT(COLOR_MAP, tga, 1, 0, 0, cmap_size);
+	}
+
+	/* FILE and descriptor agree that the image is complete */
+	__TGASeek(tga, total, SEEK_SET);
+	if (!__TGA_SUCCEEDED(tga)) {
+		TGAWriteUnmap(tga);
+		return __TGA_LASTERR(tga);
+	}
+
+	*pixels = tga->map + TGA_IMG_DATA_OFF(tga);
+	return TGA_OK;
+}
+
+
+int
+TGAWriteUnmap(TGA *tga)
+{
+	if (!tga) return TGA_ERROR;
+	if (!tga->map) {
+		return TGA_OK;
+	}
+
+	int err = msync(tga->map, (size_t) tga->map_size, MS_SYNC) ?
+		TGA_WRITE_FAIL : TGA_OK;
+	TGA_TRACE_EVENT(ROWS, tga, 1, 0, tga->hdr.height,
+		TGA_IMG_DATA_SIZE(tga));
+	munmap(tga->map, (size_t) tga->map_size);
+	tga->map = NULL;
+	tga->map_size = 0;
+
+	if (err != TGA_OK) {
+		TGA_ERROR(tga, err);
+		return __TGA_LASTERR(tga);
+	}
+	return TGA_OK;
+}
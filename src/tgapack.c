@@ -0,0 +1,412 @@
+/*
+ *  tgapack.c - Pack files of many images with a name index
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* fmemopen, mmap */
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tga.h>
+#include "tga_private.h"
+
+/*
+ * Layout, all integers little endian:
+ *
+ *   member files, back to back, unchanged
+ *   index: count entries of { u64 offset, u64 size, u32 name offset,
+ *          u32 name length }, sorted by name, then the names
+ *   trailer: { u64 index offset, u32 count, u32 reserved, magic }
+ */
+#define PACK_MAGIC	"TGAPACK1"
+#define PACK_ENTRY_SIZE	24
+#define PACK_TAIL_SIZE	24
+
+struct _TGAPack {
+	const tbyte	*base;		/* the mapped file */
+	size_t		 size;
+	tuint32		 count;
+	const tbyte	*index;
+	const tbyte	*names;
+	size_t		 names_size;
+};
+
+typedef struct _PackMember {
+	char	*name;
+	tuint64	 off;
+	tuint64	 size;
+} PackMember;
+
+struct _TGAPackWriter {
+	FILE		*fd;
+	tuint64		 off;
+	PackMember	*members;
+	size_t		 count;
+	size_t		 capacity;
+	int		 last;		/* first error, reported by TGAPackFinish */
+};
+
+
+static void
+put_le(tbyte  *buf,
+       tuint64 val,
+       size_t  n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		buf[i] = (val >> (8 * i)) & 0xff;
+	}
+}
+
+
+static tuint64
+get_le(const tbyte *buf,
+       size_t	    n)
+{
+	tuint64 val = 0;
+	for (size_t i = n; i-- > 0;) {
+		val = (val << 8) | buf[i];
+	}
+	return val;
+}
+
+
+TGAPackWriter*
+TGAPackCreate(const char *name)
+{
+	TGAPackWriter *w = (TGAPackWriter*) calloc(1, sizeof(TGAPackWriter));
+	if (!w) {
+		return NULL;
+	}
+	w->fd = fopen(name, "wb");
+	if (!w->fd) {
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+
+int
+TGAPackAdd(TGAPackWriter *w,
+	   const char	 *member,
+	   const tbyte	 *bytes,
+	   size_t	  size)
+{
+	if (!w || !member || (!bytes && size)) return TGA_ERROR;
+	if (w->last != TGA_OK) return w->last;
+
+	if (w->count == w->capacity) {
+		size_t capacity = w->capacity ? w->capacity * 2 : 64;
+		PackMember *members = (PackMember*) realloc(w->members,
+			capacity * sizeof(PackMember));
+		if (!members) {
+			return w->last = TGA_OOM;
+		}
+		w->members = members;
+		w->capacity = capacity;
+	}
+
+	PackMember *m = &w->members[w->count];
+	m->name = (char*) malloc(strlen(member) + 1);
+	if (!m->name) {
+		return w->last = TGA_OOM;
+	}
+	strcpy(m->name, member);
+	m->off = w->off;
+	m->size = size;
+	w->count += 1;
+
+	if (size && fwrite(bytes, size, 1, w->fd) != 1) {
+		return w->last = TGA_WRITE_FAIL;
+	}
+	w->off += size;
+	return TGA_OK;
+}
+
+
+int
+TGAPackAddFile(TGAPackWriter *w,
+	       const char    *member,
+	       const char    *file)
+{
+	if (!w || !member || !file) return TGA_ERROR;
+	if (w->last != TGA_OK) return w->last;
+
+	FILE *fd = fopen(file, "rb");
+	if (!fd) {
+		return TGA_OPEN_FAIL;
+	}
+	tbyte *bytes = NULL;
+	long size = -1;
+	if (fseek(fd, 0, SEEK_END) == 0) {
+		size = ftell(fd);
+	}
+	if (size >= 0) {
+		bytes = (tbyte*) malloc(size ? size : 1);
+	}
+	int result = TGA_READ_FAIL;
+	if (size >= 0 && !bytes) {
+		result = TGA_OOM;
+	} else if (bytes && fseek(fd, 0, SEEK_SET) == 0 &&
+		   fread(bytes, 1, size, fd) == (size_t) size) {
+		result = TGAPackAdd(w, member, bytes, size);
+	}
+	free(bytes);
+	fclose(fd);
+	return result;
+}
+
+
+static int
+compare_members(const void *a,
+		const void *b)
+{
+	return strcmp(((const PackMember*) a)->name,
+		((const PackMember*) b)->name);
+}
+
+
+int
+TGAPackFinish(TGAPackWriter *w)
+{
+	if (!w) return TGA_ERROR;
+
+	int result = w->last;
+	if (result == TGA_OK) {
+		qsort(w->members, w->count, sizeof(PackMember), compare_members);
+	}
+	for (size_t i = 1; i < w->count && result == TGA_OK; ++i) {
+		if (!strcmp(w->members[i - 1].name, w->members[i].name)) {
+			result = TGA_ERROR;	/* duplicate name */
+		}
+	}
+
+	const tuint64 index_off = w->off;
+	tuint64 name_off = 0;
+	for (size_t i = 0; i < w->count && result == TGA_OK; ++i) {
+		tbyte entry[PACK_ENTRY_SIZE];
+		const size_t len = strlen(w->members[i].name);
+		put_le(entry, w->members[i].off, 8);
+		put_le(entry + 8, w->members[i].size, 8);
+		put_le(entry + 16, name_off, 4);
+		put_le(entry + 20, len, 4);
+		name_off += len;
+		if (fwrite(entry, PACK_ENTRY_SIZE, 1, w->fd) != 1) {
+			result = TGA_WRITE_FAIL;
+		}
+	}
+	for (size_t i = 0; i < w->count && result == TGA_OK; ++i) {
+		const size_t len = strlen(w->members[i].name);
+		if (len && fwrite(w->members[i].name, len, 1, w->fd) != 1) {
+			result = TGA_WRITE_FAIL;
+		}
+	}
+	if (result == TGA_OK) {
+		tbyte tail[PACK_TAIL_SIZE];
+		put_le(tail, index_off, 8);
+		put_le(tail + 8, w->count, 4);
+		put_le(tail + 12, 0, 4);
+		memcpy(tail + 16, PACK_MAGIC, 8);
+		if (fwrite(tail, PACK_TAIL_SIZE, 1, w->fd) != 1) {
+			result = TGA_WRITE_FAIL;
+		}
+	}
+
+	if (fclose(w->fd) && result == TGA_OK) {
+		result = TGA_WRITE_FAIL;
+	}
+	for (size_t i = 0; i < w->count; ++i) {
+		free(w->members[i].name);
+	}
+	free(w->members);
+	free(w);
+	return result;
+}
+
+
+/* Check the trailer and that every entry lies within the file, so that
+ * lookups need no bounds checks. */
+static int
+parse_index(TGAPack *pack)
+{
+	if (pack->size < PACK_TAIL_SIZE) {
+		return 0;
+	}
+	const tbyte *tail = pack->base + pack->size - PACK_TAIL_SIZE;
+	if (memcmp(tail + 16, PACK_MAGIC, 8)) {
+		return 0;
+	}
+
+	const tuint64 index_off = get_le(tail, 8);
+	const tuint64 count = get_le(tail + 8, 4);
+	const tuint64 index_end = pack->size - PACK_TAIL_SIZE;
+	if (index_off > index_end ||
+	    count > (index_end - index_off) / PACK_ENTRY_SIZE) {
+		return 0;
+	}
+	pack->count = count;
+	pack->index = pack->base + index_off;
+	pack->names = pack->index + count * PACK_ENTRY_SIZE;
+	pack->names_size = index_end - index_off - count * PACK_ENTRY_SIZE;
+
+	for (tuint32 i = 0; i < pack->count; ++i) {
+		const tbyte *entry = pack->index + i * PACK_ENTRY_SIZE;
+		const tuint64 off = get_le(entry, 8);
+		const tuint64 size = get_le(entry + 8, 8);
+		const tuint64 name_off = get_le(entry + 16, 4);
+		const tuint64 name_len = get_le(entry + 20, 4);
+		if (off > index_off || size > index_off - off ||
+		    name_off > pack->names_size ||
+		    name_len > pack->names_size - name_off) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+TGAPack*
+TGAPackOpen(const char *name)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	TGAPack *pack = (TGAPack*) calloc(1, sizeof(TGAPack));
+	if (!pack || fstat(fd, &st) || st.st_size == 0 ||
+	    (tuint64) st.st_size > SIZE_MAX) {
+		free(pack);
+		close(fd);
+		return NULL;
+	}
+
+	pack->size = st.st_size;
+	void *base = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		free(pack);
+		return NULL;
+	}
+	pack->base = (const tbyte*) base;
+
+	if (!parse_index(pack)) {
+		TGAPackClose(pack);
+		return NULL;
+	}
+	return pack;
+}
+
+
+void
+TGAPackClose(TGAPack *pack)
+{
+	if (pack) {
+		munmap((void*) pack->base, pack->size);
+		free(pack);
+	}
+}
+
+
+size_t
+TGAPackCount(const TGAPack *pack)
+{
+	return pack ? pack->count : 0;
+}
+
+
+const char*
+TGAPackName(const TGAPack *pack,
+	    size_t	   i,
+	    size_t	  *len)
+{
+	if (!pack || i >= pack->count) return NULL;
+
+	const tbyte *entry = pack->index + i * PACK_ENTRY_SIZE;
+	if (len) {
+		*len = get_le(entry + 20, 4);
+	}
+	return (const char*) pack->names + get_le(entry + 16, 4);
+}
+
+
+const tbyte*
+TGAPackFind(const TGAPack *pack,
+	    const char	  *member,
+	    size_t	  *size)
+{
+	if (!pack || !member) return NULL;
+
+	const size_t len = strlen(member);
+	size_t lo = 0;
+	size_t hi = pack->count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const tbyte *entry = pack->index + mid * PACK_ENTRY_SIZE;
+		const size_t name_len = get_le(entry + 20, 4);
+		const tbyte *name = pack->names + get_le(entry + 16, 4);
+		int cmp = memcmp(name, member, name_len < len ? name_len : len);
+		if (cmp == 0) {
+			cmp = (name_len > len) - (name_len < len);
+		}
+		if (cmp == 0) {
+			if (size) {
+				*size = get_le(entry + 8, 8);
+			}
+			return pack->base + get_le(entry, 8);
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+
+TGA*
+TGAPackOpenMember(const TGAPack *pack,
+		  const char	*member)
+{
+	size_t size;
+	const tbyte *bytes = TGAPackFind(pack, member, &size);
+	if (!bytes || size == 0) {
+		return NULL;
+	}
+
+	/* a read-only stream straight over the mapping, no copy */
+	FILE *fd = fmemopen((void*) bytes, size, "rb");
+	if (!fd) {
+		return NULL;
+	}
+	TGA *tga = TGAOpenFd(fd);
+	if (!tga) {
+		fclose(fd);
+		return NULL;
+	}
+	TGASetStreamSize(tga, size);
+	return tga;
+}
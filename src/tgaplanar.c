@@ -0,0 +1,164 @@
+/*
+ *  tgaplanar.c - Planar and normalized float output
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tga.h>
+#include "tga_private.h"
+
+
+/* IEEE half from float, round to nearest even */
+static tuint16
+float_to_half(float f)
+{
+	union { float f; tuint32 u; } v;
+	v.f = f;
+	tuint32 sign = (v.u >> 16) & 0x8000;
+	tuint32 exp = (v.u >> 23) & 0xff;
+	tuint32 mant = v.u & 0x7fffff;
+
+	if (exp == 0xff) {
+		return sign | 0x7c00 | (mant ? 0x200 : 0);
+	}
+	int e = (int) exp - 127 + 15;
+	if (e >= 0x1f) {
+		return sign | 0x7c00;
+	}
+
+	tuint32 half, rem, mid;
+	if (e <= 0) {
+		if (e < -10) {
+			return sign;
+		}
+		mant |= 0x800000;
+		int shift = 14 - e;
+		half = mant >> shift;
+		rem = mant & ((1u << shift) - 1);
+		mid = 1u << (shift - 1);
+	} else {
+		half = ((tuint32) e << 10) | (mant >> 13);
+		rem = mant & 0x1fff;
+		mid = 0x1000;
+	}
+	/* a carry out of the mantissa correctly bumps the exponent */
+	if (rem > mid || (rem == mid && (half & 1))) {
+		++half;
+	}
+	return sign | half;
+}
+
+
+static float
+srgb_to_linear(float c)
+{
+	return c <= 0.04045f ? c / 12.92f : (float) pow((c + 0.055) / 1.055, 2.4);
+}
+
+
+int
+TGAReadPlanar(TGA	      *tga,
+	      void	      *dst,
+	      const TGAPlanar *fmt,
+	      tuint32	       flags)
+{
+	if (!tga) return TGA_ERROR;
+	if (!dst || !fmt || !TGA_IMGTYPE_AVAILABLE(tga) ||
+	    TGA_IMGTYPE_IS_MAPPED(tga) || fmt->planes < 1 || fmt->planes > 4 ||
+	    fmt->type < TGA_PLANAR_U8 || fmt->type > TGA_PLANAR_F16 ||
+	    tga->hdr.width == 0) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+
+	const size_t line_size = TGAScanlineSize(tga);
+	const size_t channels = line_size / tga->hdr.width;
+	const size_t width = tga->hdr.width;
+	const size_t plane_size = width * tga->hdr.height;
+	const int unpack = tga->hdr.depth == 15 || tga->hdr.depth == 16;
+	for (size_t p = 0; p < fmt->planes; ++p) {
+		if (fmt->channel[p] >= channels) {
+			TGA_ERROR(tga, TGA_ERROR);
+			return __TGA_LASTERR(tga);
+		}
+	}
+
+	/* every decoded byte maps through a per plane table */
+	float lut[4][256];
+	tuint16 hlut[4][256];
+	if (fmt->type != TGA_PLANAR_U8) {
+		const float max = unpack ? 31.0f : 255.0f;
+		for (size_t p = 0; p < fmt->planes; ++p) {
+			const int color = fmt->srgb && fmt->channel[p] != 3;
+			const float std = fmt->std[p] != 0.0f ? fmt->std[p] : 1.0f;
+			for (int v = 0; v < 256; ++v) {
+				float c = v / max;
+				if (color) {
+					c = srgb_to_linear(c);
+				}
+				lut[p][v] = (c - fmt->mean[p]) / std;
+				hlut[p][v] = float_to_half(lut[p][v]);
+			}
+		}
+	}
+
+	if (__TGACheckLimits(tga, __TGAMinFileSize(tga, 0), line_size) != TGA_OK) {
+		return __TGA_LASTERR(tga);
+	}
+
+	tbyte *line = (tbyte*) malloc(line_size);
+	if (!line) {
+		TGA_ERROR(tga, TGA_OOM);
+		return __TGA_LASTERR(tga);
+	}
+
+	tga->row = 0;
+	for (size_t y = 0; y < tga->hdr.height; ++y) {
+		TGAReadScanline(tga, line, flags);
+		if (!__TGA_SUCCEEDED(tga)) {
+			break;
+		}
+
+		const size_t row = y * width;
+		for (size_t p = 0; p < fmt->planes; ++p) {
+			const tbyte *src = line + fmt->channel[p];
+			const size_t base = p * plane_size + row;
+			if (fmt->type == TGA_PLANAR_U8) {
+				tbyte *out = (tbyte*) dst + base;
+				for (size_t x = 0; x < width; ++x) {
+					out[x] = src[x * channels];
+				}
+			} else if (fmt->type == TGA_PLANAR_F32) {
+				float *out = (float*) dst + base;
+				for (size_t x = 0; x < width; ++x) {
+					out[x] = lut[p][src[x * channels]];
+				}
+			} else {
+				tuint16 *out = (tuint16*) dst + base;
+				for (size_t x = 0; x < width; ++x) {
+					out[x] = hlut[p][src[x * channels]];
+				}
+			}
+		}
+	}
+
+	free(line);
+	return __TGA_LASTERR(tga);
+}
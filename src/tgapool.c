@@ -0,0 +1,186 @@
+/*
+ *  tgapool.c - Pool of reusable handles and image buffers
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tga.h>
+#include "tga_private.h"
+
+struct _TGAPool {
+	pthread_mutex_t	lock;
+	size_t		capacity;	/* max. idle handles and TGAData each */
+	size_t		n_tga;
+	size_t		n_data;
+	TGA		**tga;		/* idle handles, fd closed and buffers freed */
+	TGAData		**data;		/* idle TGAData, buffers kept */
+};
+
+
+TGAPool*
+TGAPoolNew(size_t capacity)
+{
+	TGAPool *pool = (TGAPool*) calloc(1, sizeof(TGAPool));
+	if (!pool) {
+		return NULL;
+	}
+
+	pool->capacity = capacity;
+	pool->tga = (TGA**) calloc(capacity ? capacity : 1, sizeof(TGA*));
+	pool->data = (TGAData**) calloc(capacity ? capacity : 1, sizeof(TGAData*));
+	if (!pool->tga || !pool->data || pthread_mutex_init(&pool->lock, NULL)) {
+		free(pool->tga);
+		free(pool->data);
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+
+void
+TGAPoolFree(TGAPool *pool)
+{
+	if (!pool) return;
+
+	/* idle handles are torn down already */
+	for (size_t i = 0; i < pool->n_tga; ++i) {
+		free(pool->tga[i]);
+	}
+	for (size_t i = 0; i < pool->n_data; ++i) {
+		TGAFreeTGAData(pool->data[i]);
+		free(pool->data[i]);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->tga);
+	free(pool->data);
+	free(pool);
+}
+
+
+TGA*
+TGAPoolOpen(TGAPool	*pool,
+	    const char	*name,
+	    const char	*mode)
+{
+	if (!pool) return NULL;
+
+	TGA *tga = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_tga) {
+		tga = pool->tga[--pool->n_tga];
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!tga) {
+		return TGAOpen(name, mode);
+	}
+
+	if (TGAReopen(tga, name, mode) != TGA_OK) {
+		TGAPoolClose(pool, tga);
+		return NULL;
+	}
+	return tga;
+}
+
+
+int
+TGAPoolClose(TGAPool *pool,
+	     TGA     *tga)
+{
+	if (!tga) return TGA_OK;
+
+	/* a parked or dropped handle would never msync its mapping */
+	const int err = TGAWriteUnmap(tga);
+	if (!pool) {
+		TGAClose(tga);
+		return err;
+	}
+
+	/* the teardown of TGAClose, minus the final free */
+	TGA_TRACE_EVENT(CLOSE, tga, 0, 0, 0, tga->off);
+	if (tga->fd) {
+		fclose(tga->fd);
+		tga->fd = NULL;
+	}
+	free(tga->row_off);
+	tga->row_off = NULL;
+	free(tga->rle_tmp);
+	tga->rle_tmp = NULL;
+	tga->rle_tmp_size = 0;
+	tga->error = (TGAErrorProc) 0;
+	tga->mem_limit = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_tga < pool->capacity) {
+		pool->tga[pool->n_tga++] = tga;
+		tga = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	free(tga);
+	return err;
+}
+
+
+TGAData*
+TGAPoolAcquireData(TGAPool *pool)
+{
+	if (!pool) return NULL;
+
+	TGAData *data = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_data) {
+		data = pool->data[--pool->n_data];
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!data) {
+		data = (TGAData*) calloc(1, sizeof(TGAData));
+		if (!data) {
+			return NULL;
+		}
+	}
+	data->flags = TGA_KEEP_BUFFERS;
+	data->stats = NULL;
+	return data;
+}
+
+
+void
+TGAPoolReleaseData(TGAPool *pool,
+		   TGAData *data)
+{
+	if (!data) return;
+
+	if (pool) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->n_data < pool->capacity) {
+			pool->data[pool->n_data++] = data;
+			data = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (data) {
+		TGAFreeTGAData(data);
+		free(data);
+	}
+}
@@ -0,0 +1,242 @@
+/*
+ *  tgapread.c - Positional reads for concurrent access
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tga.h>
+#include "tga_private.h"
+
+#define INDEX_CHUNK	65536
+
+
+int
+__TGAPreadFull(int	fd,
+	       tbyte   *buf,
+	       size_t	n,
+	       tuint64	off)
+{
+	while (n > 0) {
+		ssize_t read = pread(fd, buf, n, off);
+		if (read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (read <= 0) {
+			return TGA_READ_FAIL;
+		}
+		buf += read;
+		n -= read;
+		off += read;
+	}
+	return TGA_OK;
+}
+
+
+int
+TGABuildRowIndex(TGA *tga)
+{
+	if (!tga) return TGA_ERROR;
+
+	if (!TGA_IMGTYPE_AVAILABLE(tga) || !TGA_IMGTYPE_IS_ENCODED(tga)) {
+		return TGA_OK;
+	}
+	if (tga->row_off) {
+		return TGA_OK;
+	}
+
+	const size_t sample_bytes = TGA_PIXEL_SIZE(tga->hdr.depth);
+	const size_t max_row = tga->hdr.width * (1 + sample_bytes);
+	const size_t cap = INDEX_CHUNK + max_row;
+	const int fd = fileno(tga->fd);
+
+	if (__TGACheckLimits(tga, __TGAMinFileSize(tga, 0), cap +
+			((tuint64) tga->hdr.height + 1) * sizeof(tuint64)) != TGA_OK) {
+		return __TGA_LASTERR(tga);
+	}
+
+	tuint64 *row_off = (tuint64*) malloc((tga->hdr.height + 1) * sizeof(tuint64));
+	tbyte *buf = (tbyte*) malloc(cap);
+	if (!row_off || !buf) {
+		free(row_off);
+		free(buf);
+		TGA_ERROR(tga, TGA_OOM);
+		return __TGA_LASTERR(tga);
+	}
+
+	/* buf holds the file from buf_off on, len bytes of it are valid */
+	tuint64 off = TGA_IMG_DATA_OFF(tga);
+	tuint64 buf_off = off;
+	size_t len = 0;
+	int eof = 0;
+	for (tshort y = 0; y < tga->hdr.height; ++y) {
+		size_t pos = off - buf_off;
+		if (len - pos < max_row && !eof) {
+			memmove(buf, buf + pos, len - pos);
+			len -= pos;
+			buf_off = off;
+			pos = 0;
+			while (len < cap && !eof) {
+				ssize_t read = pread(fd, buf + len, cap - len, buf_off + len);
+				if (read < 0 && errno == EINTR) {
+					continue;
+				}
+				if (read < 0) {
+					free(row_off);
+					free(buf);
+					TGA_ERROR(tga, TGA_READ_FAIL);
+					return __TGA_LASTERR(tga);
+				}
+				eof = read == 0;
+				len += read;
+			}
+		}
+
+		row_off[y] = off;
+		size_t used = __TGADecodeRLE(buf + pos, len - pos, NULL,
+			tga->hdr.width, sample_bytes);
+		if (!used) {
+			/* truncated, or packets cross scanlines */
+			free(row_off);
+			free(buf);
+			TGA_ERROR(tga, TGA_ERROR);
+			return __TGA_LASTERR(tga);
+		}
+		off += used;
+	}
+	row_off[tga->hdr.height] = off;
+
+	free(buf);
+	tga->row_off = row_off;
+	return TGA_OK;
+}
+
+
+int
+TGAReadRowsAt(const TGA *tga,
+	      tbyte	*buf,
+	      tuint32	 first,
+	      tuint32	 count,
+	      tuint32	 flags)
+{
+	if (!tga) return TGA_ERROR;
+	return TGAReadRegionAt(tga, buf, 0, first, tga->hdr.width, count, flags);
+}
+
+
+int
+TGAReadRegionAt(const TGA *tga,
+		tbyte	  *buf,
+		tuint32	   x,
+		tuint32	   y,
+		tuint32	   w,
+		tuint32	   h,
+		tuint32	   flags)
+{
+	if (!tga || !buf || !TGA_IMGTYPE_AVAILABLE(tga) ||
+	    x > tga->hdr.width || w > tga->hdr.width - x ||
+	    y > tga->hdr.height || h > tga->hdr.height - y) {
+		return TGA_ERROR;
+	}
+	if (w == 0 || h == 0) {
+		return TGA_OK;
+	}
+
+	const TGAKernel *k = __TGACachedKernel(tga, flags);
+	if (!k) {
+		return TGA_UNKNOWN_SUB_FORMAT;
+	}
+
+	const int fd = fileno(tga->fd);
+	const size_t sample_bytes = k->sample_bytes;
+	const size_t pitch = w * k->out_bytes;
+
+	if (!TGA_IMGTYPE_IS_ENCODED(tga)) {
+		const tuint64 sln_size = TGA_SCANLINE_SIZE(tga);
+		for (tuint32 r = 0; r < h; ++r) {
+			tuint64 off = TGA_IMG_DATA_OFF(tga) +
+				(tuint64) (y + r) * sln_size +
+				(tuint64) x * sample_bytes;
+			if (__TGAPreadFull(fd, buf + r * pitch, w * sample_bytes,
+					off)) {
+				return TGA_READ_FAIL;
+			}
+			if (k->convert) {
+				k->convert(buf + r * pitch, buf + r * pitch, w);
+			}
+		}
+		TGA_TRACE_EVENT(ROWS, tga, 0, y, h, (tuint64) h * w * sample_bytes);
+		if (k->convert) {
+			TGA_TRACE_EVENT(CONVERT, tga, 0, y, h, (tuint64) h * pitch);
+		}
+		return TGA_OK;
+	}
+
+	if (!tga->row_off) {
+		return TGA_ERROR;
+	}
+
+	/* one read for the compressed span of all requested rows */
+	const tuint64 span_off = tga->row_off[y];
+	const tuint64 span = tga->row_off[y + h] - span_off;
+	if (!TGA_SIZE_OK(span)) {
+		return TGA_OOM;
+	}
+	if (tga->mem_limit && span + TGA_SCANLINE_SIZE(tga) > tga->mem_limit) {
+		return TGA_TOO_LARGE;
+	}
+	tbyte *src = (tbyte*) malloc(span);
+	tbyte *line = (tbyte*) malloc(TGA_SCANLINE_SIZE(tga));
+	int result = TGA_OK;
+	if (!src || !line) {
+		result = TGA_OOM;
+	} else {
+		result = __TGAPreadFull(fd, src, span, span_off);
+	}
+
+	for (tuint32 r = 0; r < h && result == TGA_OK; ++r) {
+		const tuint64 off = tga->row_off[y + r];
+		if (!__TGADecodeRLE(src + (off - span_off),
+				tga->row_off[y + r + 1] - off, line,
+				tga->hdr.width, sample_bytes)) {
+			result = TGA_ERROR;
+			break;
+		}
+		if (k->convert) {
+			k->convert(line + x * sample_bytes, buf + r * pitch, w);
+		} else {
+			memcpy(buf + r * pitch, line + x * sample_bytes,
+				w * sample_bytes);
+		}
+	}
+
+	free(src);
+	free(line);
+	if (result == TGA_OK) {
+		TGA_TRACE_EVENT(ROWS, tga, 0, y, h, span);
+		if (k->convert) {
+			TGA_TRACE_EVENT(CONVERT, tga, 0, y, h, (tuint64) h * pitch);
+		}
+	}
+	return result;
+}
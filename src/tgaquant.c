@@ -0,0 +1,505 @@
+/*
+ *  tgaquant.c - Palette quantization of truecolor images
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* sysconf */
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tga.h>
+#include "tga_private.h"
+
+#define MAX_THREADS	64
+/* histogram threads, each has a private copy of up to 5 MB */
+#define MAX_HIST_THREADS 8
+/* pixels looked at to build the histogram */
+#define SAMPLE_MAX	(1 << 22)
+#define KMEANS_ITERS	5
+#define NO_INDEX	0xffff
+
+/*
+ * Colors are binned at 5 bits per color channel and 3 bits of alpha. A
+ * histogram of sampled pixels is reduced to the palette by median cut
+ * and refined with a few k-means iterations; every pixel then maps to
+ * the entry nearest to the mean color of its bin. All sums are integer
+ * and merged in a fixed order, so the result does not depend on the
+ * number of threads.
+ */
+
+typedef struct _Point {
+	tuint32	count;
+	tuint32	sum[4];
+	tbyte	mean[4];
+} Point;
+
+typedef struct _Quant {
+	const tbyte	*img;
+	tbyte		*out;
+	size_t		 n;		/* pixels */
+	size_t		 sb;		/* bytes per pixel, 3 or 4 */
+	size_t		 bins;
+	size_t		 step;		/* histogram sampling stride */
+	tuint32		*hist[MAX_HIST_THREADS]; /* count, sum[4] per bin */
+	Point		*points;	/* occupied bins */
+	size_t		 n_points;
+	tbyte		 palette[256][4];
+	size_t		 n_colors;
+	tuint64		*acc[MAX_THREADS]; /* k-means: count, sum[4] per entry */
+	int		 failed;
+} Quant;
+
+typedef void (*PartProc)(Quant *q, size_t part, size_t parts);
+
+typedef struct _Job {
+	PartProc	 proc;
+	Quant		*q;
+	size_t		 part;
+	size_t		 parts;
+} Job;
+
+
+static void *
+job_main(void *arg)
+{
+	Job *job = (Job*) arg;
+	job->proc(job->q, job->part, job->parts);
+	return NULL;
+}
+
+
+/* Run proc on parts slices of the work, part 0 on the calling thread. */
+static void
+run_parallel(Quant    *q,
+	     PartProc  proc,
+	     size_t    parts)
+{
+	pthread_t tid[MAX_THREADS];
+	Job jobs[MAX_THREADS];
+	int started[MAX_THREADS];
+
+	for (size_t i = 1; i < parts; ++i) {
+		jobs[i].proc = proc;
+		jobs[i].q = q;
+		jobs[i].part = i;
+		jobs[i].parts = parts;
+		started[i] = !pthread_create(&tid[i], NULL, job_main, &jobs[i]);
+		if (!started[i]) {
+			proc(q, i, parts);
+		}
+	}
+	proc(q, 0, parts);
+	for (size_t i = 1; i < parts; ++i) {
+		if (started[i]) {
+			pthread_join(tid[i], NULL);
+		}
+	}
+}
+
+
+static inline size_t
+bin_of(const tbyte *p,
+       size_t	    sb)
+{
+	size_t bin = ((size_t) (p[0] >> 3) << 10) | ((p[1] >> 3) << 5) |
+		(p[2] >> 3);
+	return sb == 4 ? bin | ((size_t) (p[3] >> 5) << 15) : bin;
+}
+
+
+static inline tuint32
+distance(const tbyte *a,
+	 const tbyte *b,
+	 size_t	      sb)
+{
+	tuint32 d = 0;
+	for (size_t c = 0; c < sb; ++c) {
+		int v = (int) a[c] - b[c];
+		d += v * v;
+	}
+	return d;
+}
+
+
+static size_t
+nearest(const Quant *q,
+	const tbyte *color)
+{
+	size_t best = 0;
+	tuint32 best_d = distance(q->palette[0], color, q->sb);
+	for (size_t i = 1; i < q->n_colors && best_d; ++i) {
+		tuint32 d = distance(q->palette[i], color, q->sb);
+		if (d < best_d) {
+			best = i;
+			best_d = d;
+		}
+	}
+	return best;
+}
+
+
+static void
+slice(size_t  n,
+      size_t  part,
+      size_t  parts,
+      size_t *begin,
+      size_t *end)
+{
+	*begin = n / parts * part + (part < n % parts ? part : n % parts);
+	*end = *begin + n / parts + (part < n % parts);
+}
+
+
+static void
+histogram_part(Quant  *q,
+	       size_t  part,
+	       size_t  parts)
+{
+	const size_t samples = (q->n + q->step - 1) / q->step;
+	size_t begin, end;
+	slice(samples, part, parts, &begin, &end);
+
+	tuint32 *hist = q->hist[part];
+	for (size_t s = begin; s < end; ++s) {
+		const tbyte *p = q->img + s * q->step * q->sb;
+		tuint32 *bin = hist + bin_of(p, q->sb) * 5;
+		bin[0] += 1;
+		for (size_t c = 0; c < q->sb; ++c) {
+			bin[1 + c] += p[c];
+		}
+	}
+}
+
+
+static void
+kmeans_part(Quant  *q,
+	    size_t  part,
+	    size_t  parts)
+{
+	size_t begin, end;
+	slice(q->n_points, part, parts, &begin, &end);
+
+	tuint64 *acc = q->acc[part];
+	memset(acc, 0, 256 * 5 * sizeof(tuint64));
+	for (size_t i = begin; i < end; ++i) {
+		const Point *pt = &q->points[i];
+		tuint64 *a = acc + nearest(q, pt->mean) * 5;
+		a[0] += pt->count;
+		for (size_t c = 0; c < q->sb; ++c) {
+			a[1 + c] += pt->sum[c];
+		}
+	}
+}
+
+
+static void
+map_part(Quant	*q,
+	 size_t	 part,
+	 size_t	 parts)
+{
+	size_t begin, end;
+	slice(q->n, part, parts, &begin, &end);
+
+	/* per thread, filled on demand */
+	tuint16 *lut = (tuint16*) malloc(q->bins * sizeof(tuint16));
+	if (!lut) {
+		q->failed = 1;
+		return;
+	}
+	memset(lut, 0xff, q->bins * sizeof(tuint16));
+
+	const tuint32 *hist = q->hist[0];
+	for (size_t i = begin; i < end; ++i) {
+		const size_t bin = bin_of(q->img + i * q->sb, q->sb);
+		if (lut[bin] == NO_INDEX) {
+			tbyte color[4];
+			const tuint32 *h = hist + bin * 5;
+			if (h[0]) {
+				for (size_t c = 0; c < q->sb; ++c) {
+					color[c] = (h[1 + c] + h[0] / 2) / h[0];
+				}
+			} else {
+				color[0] = ((bin >> 10) & 0x1f) << 3 | 4;
+				color[1] = ((bin >> 5) & 0x1f) << 3 | 4;
+				color[2] = (bin & 0x1f) << 3 | 4;
+				color[3] = (bin >> 15) << 5 | 16;
+			}
+			lut[bin] = nearest(q, color);
+		}
+		q->out[i] = lut[bin];
+	}
+	free(lut);
+}
+
+
+#define COMPARE_CHANNEL(c) \
+	static int \
+	compare_channel##c(const void *a, \
+			   const void *b) \
+	{ \
+		const tbyte x = ((const Point*) a)->mean[c]; \
+		const tbyte y = ((const Point*) b)->mean[c]; \
+		return (x > y) - (x < y); \
+	}
+
+COMPARE_CHANNEL(0)
+COMPARE_CHANNEL(1)
+COMPARE_CHANNEL(2)
+COMPARE_CHANNEL(3)
+
+static int (*const compare_channel[4])(const void*, const void*) = {
+	compare_channel0, compare_channel1, compare_channel2, compare_channel3
+};
+
+
+/* Median cut of the histogram points into at most max boxes, whose
+ * means make the initial palette. */
+static void
+median_cut(Quant  *q,
+	   size_t  max)
+{
+	size_t start[256], end[256];
+	size_t n_boxes = 1;
+	start[0] = 0;
+	end[0] = q->n_points;
+
+	while (n_boxes < max) {
+		/* the box with the largest population weighted extent */
+		size_t best = n_boxes;
+		size_t best_channel = 0;
+		tuint64 best_score = 0;
+		for (size_t b = 0; b < n_boxes; ++b) {
+			if (end[b] - start[b] < 2) continue;
+			tbyte lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+			tuint64 weight = 0;
+			for (size_t i = start[b]; i < end[b]; ++i) {
+				for (size_t c = 0; c < q->sb; ++c) {
+					if (q->points[i].mean[c] < lo[c]) lo[c] = q->points[i].mean[c];
+					if (q->points[i].mean[c] > hi[c]) hi[c] = q->points[i].mean[c];
+				}
+				weight += q->points[i].count;
+			}
+			for (size_t c = 0; c < q->sb; ++c) {
+				tuint64 score = (tuint64) (hi[c] - lo[c]) * weight;
+				if (score > best_score) {
+					best = b;
+					best_channel = c;
+					best_score = score;
+				}
+			}
+		}
+		if (best == n_boxes) {
+			break;
+		}
+
+		Point *pts = q->points + start[best];
+		const size_t len = end[best] - start[best];
+		qsort(pts, len, sizeof(Point), compare_channel[best_channel]);
+
+		tuint64 total = 0, half = 0;
+		for (size_t i = 0; i < len; ++i) total += pts[i].count;
+		size_t split = 1;
+		for (; split < len - 1; ++split) {
+			half += pts[split - 1].count;
+			if (half * 2 >= total) break;
+		}
+		start[n_boxes] = start[best] + split;
+		end[n_boxes] = end[best];
+		end[best] = start[best] + split;
+		++n_boxes;
+	}
+
+	for (size_t b = 0; b < n_boxes; ++b) {
+		tuint64 sum[4] = { 0, 0, 0, 0 }, count = 0;
+		for (size_t i = start[b]; i < end[b]; ++i) {
+			count += q->points[i].count;
+			for (size_t c = 0; c < q->sb; ++c) {
+				sum[c] += q->points[i].sum[c];
+			}
+		}
+		for (size_t c = 0; c < 4; ++c) {
+			q->palette[b][c] = count ? (sum[c] + count / 2) / count : 0;
+		}
+	}
+	q->n_colors = n_boxes;
+}
+
+
+/* Images with at most max colors keep them exactly. Returns the number
+ * of colors, 0 if there are more. */
+static size_t
+exact_palette(Quant  *q,
+	      size_t  max)
+{
+	enum { SLOTS = 1024 };
+	tuint32 key[SLOTS];
+	tbyte index[SLOTS];
+	tbyte used[SLOTS];
+	memset(used, 0, sizeof(used));
+
+	size_t n_colors = 0;
+	tuint32 last = 0;
+	tbyte last_index = 0;
+	for (size_t i = 0; i < q->n; ++i) {
+		const tbyte *p = q->img + i * q->sb;
+		tuint32 k = p[0] | (p[1] << 8) | ((tuint32) p[2] << 16) |
+			(q->sb == 4 ? (tuint32) p[3] << 24 : 0);
+		if (i == 0 || k != last) {
+			size_t s = (k * 2654435761u) >> 22;
+			while (used[s] && key[s] != k) {
+				s = (s + 1) & (SLOTS - 1);
+			}
+			if (!used[s]) {
+				if (n_colors == max) {
+					return 0;
+				}
+				used[s] = 1;
+				key[s] = k;
+				index[s] = n_colors;
+				memcpy(q->palette[n_colors], p, q->sb);
+				++n_colors;
+			}
+			last = k;
+			last_index = index[s];
+		}
+		q->out[i] = last_index;
+	}
+	return n_colors;
+}
+
+
+int
+TGAQuantize(TGA	    *tga,
+	    TGAData *data,
+	    tuint16  colors,
+	    tuint32  threads)
+{
+	if (!tga) return TGA_ERROR;
+	if (!data || !data->img_data || !TGA_IMGTYPE_IS_TRUEC(tga) ||
+	    (tga->hdr.depth != 24 && tga->hdr.depth != 32) || colors == 1 ||
+	    colors > 256) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+	if (colors == 0) colors = 256;
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+	Quant q;
+	memset(&q, 0, sizeof(q));
+	q.img = data->img_data;
+	q.n = (size_t) tga->hdr.width * tga->hdr.height;
+	q.sb = TGA_PIXEL_SIZE(tga->hdr.depth);
+	q.bins = q.sb == 4 ? 1 << 18 : 1 << 15;
+	q.out = (tbyte*) malloc(q.n ? q.n : 1);
+	if (!q.out) {
+		TGA_ERROR(tga, TGA_OOM);
+		return __TGA_LASTERR(tga);
+	}
+
+	/* an image without pixels gets an empty color map */
+	q.n_colors = exact_palette(&q, colors);
+	if (q.n_colors == 0 && q.n != 0) {
+		const size_t hist_parts = threads < MAX_HIST_THREADS ?
+			threads : MAX_HIST_THREADS;
+		q.step = (q.n + SAMPLE_MAX - 1) / SAMPLE_MAX;
+		for (size_t t = 0; t < hist_parts && !q.failed; ++t) {
+			q.hist[t] = (tuint32*) calloc(q.bins * 5, sizeof(tuint32));
+			q.failed = !q.hist[t];
+		}
+		for (size_t t = 0; t < threads && !q.failed; ++t) {
+			q.acc[t] = (tuint64*) malloc(256 * 5 * sizeof(tuint64));
+			q.failed = !q.acc[t];
+		}
+		q.points = (Point*) malloc(q.bins * sizeof(Point));
+		q.failed = q.failed || !q.points;
+
+		if (!q.failed) {
+			run_parallel(&q, histogram_part, hist_parts);
+			for (size_t t = 1; t < hist_parts; ++t) {
+				for (size_t i = 0; i < q.bins * 5; ++i) {
+					q.hist[0][i] += q.hist[t][i];
+				}
+			}
+
+			for (size_t b = 0; b < q.bins; ++b) {
+				const tuint32 *h = q.hist[0] + b * 5;
+				if (!h[0]) continue;
+				Point *pt = &q.points[q.n_points++];
+				pt->count = h[0];
+				for (size_t c = 0; c < 4; ++c) {
+					pt->sum[c] = h[1 + c];
+					pt->mean[c] = (h[1 + c] + h[0] / 2) / h[0];
+				}
+			}
+
+			median_cut(&q, colors);
+			for (int iter = 0; iter < KMEANS_ITERS; ++iter) {
+				run_parallel(&q, kmeans_part, threads);
+				for (size_t k = 0; k < q.n_colors; ++k) {
+					tuint64 sum[5] = { 0, 0, 0, 0, 0 };
+					for (size_t t = 0; t < threads; ++t) {
+						for (size_t c = 0; c < 5; ++c) {
+							sum[c] += q.acc[t][k * 5 + c];
+						}
+					}
+					for (size_t c = 0; sum[0] && c < q.sb; ++c) {
+						q.palette[k][c] = (sum[1 + c] + sum[0] / 2) / sum[0];
+					}
+				}
+			}
+			run_parallel(&q, map_part, threads);
+		}
+
+		for (size_t t = 0; t < MAX_HIST_THREADS; ++t) {
+			free(q.hist[t]);
+		}
+		for (size_t t = 0; t < MAX_THREADS; ++t) {
+			free(q.acc[t]);
+		}
+		free(q.points);
+	}
+
+	if (q.failed || !__TGAReserve(data, &data->cmap, &data->cmap_size,
+			q.n_colors * q.sb)) {
+		free(q.out);
+		TGA_ERROR(tga, TGA_OOM);
+		return __TGA_LASTERR(tga);
+	}
+	for (size_t k = 0; k < q.n_colors; ++k) {
+		memcpy(data->cmap + k * q.sb, q.palette[k], q.sb);
+	}
+	memcpy(data->img_data, q.out, q.n);
+	free(q.out);
+
+	tga->hdr.map_t = 1;
+	tga->hdr.map_first = 0;
+	tga->hdr.map_len = q.n_colors;
+	tga->hdr.map_entry = tga->hdr.depth;
+	tga->hdr.depth = 8;
+	tga->hdr.img_t = TGA_IMGTYPE_UNCOMP_CMAP | (tga->hdr.img_t & 0x8);
+	data->flags |= TGA_COLOR_MAP;
+	return TGA_OK;
+}
@@ -21,10 +21,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <tga.h>
 #include "tga_private.h"
 
+/* raw scanlines read at once by TGAReadScanlines */
+#define READ_BAND_BYTES	(256 * 1024)
+
 size_t
 TGARead(TGA    *tga,
 	tbyte  *buf,
@@ -35,13 +39,14 @@ TGARead(TGA    *tga,
 	if (read != n) {
 		TGA_ERROR(tga, TGA_READ_FAIL);
 	}
-	tga->off = ftell(tga->fd);
+	tga->off += read * size;
 	return read;
 }
 
-int
-TGAReadImage(TGA     *tga,
-	     TGAData *data)
+static int
+read_image(TGA     *tga,
+	   TGAData *data,
+	   tuint8   scale)
 {
 	if (!tga) return TGA_ERROR;
 	if (!data) {
@@ -56,9 +61,14 @@ TGAReadImage(TGA     *tga,
 	}
 	data->flags |= TGA_IMAGE_INFO;
 
-	data->img_id = (tbyte *) 0;
-	data->cmap = (tbyte *) 0;
-	data->img_data = (tbyte *) 0;
+	if (!(data->flags & TGA_KEEP_BUFFERS)) {
+		data->img_id = (tbyte *) 0;
+		data->cmap = (tbyte *) 0;
+		data->img_data = (tbyte *) 0;
+		data->img_id_size = 0;
+		data->cmap_size = 0;
+		data->img_data_size = 0;
+	}
 
 	if (data->flags & TGA_IMAGE_ID) {
 		TGAReadImageId(tga, data);
@@ -77,7 +87,7 @@ TGAReadImage(TGA     *tga,
 			data->flags &= ~TGA_COLOR_MAP;
 		}
 
-		TGAReadScanlines(tga, data);
+		TGAReadScanlinesScaled(tga, data, scale);
 		if (!__TGA_SUCCEEDED(tga)) {
 			return __TGA_LASTERR(tga);
 		}
@@ -86,6 +96,23 @@ TGAReadImage(TGA     *tga,
 }
 
 
+int
+TGAReadImage(TGA     *tga,
+	     TGAData *data)
+{
+	return read_image(tga, data, 1);
+}
+
+
+int
+TGAReadImageScaled(TGA     *tga,
+		   TGAData *data,
+		   tuint8   scale)
+{
+	return read_image(tga, data, scale);
+}
+
+
 void
 TGAFreeTGAData(TGAData *data)
 {
@@ -98,6 +125,9 @@ TGAFreeTGAData(TGAData *data)
 	data->cmap = 0;
 	data->img_data = 0;
 	data->img_id = 0;
+	data->cmap_size = 0;
+	data->img_data_size = 0;
+	data->img_id_size = 0;
 }
 
 
@@ -119,6 +149,18 @@ TGAReadHeader (TGA *tga)
 		return __TGA_LASTERR(tga);
 	}
 
+	tga->row = 0;
+	if (__TGAParseHeader(tga, tmp) == TGA_OK) {
+		TGA_TRACE_EVENT(HEADER, tga, 0, 0, 0, TGA_HEADER_SIZE);
+	}
+	return __TGA_LASTERR(tga);
+}
+
+
+int
+__TGAParseHeader(TGA	     *tga,
+		 const tbyte *tmp)
+{
 	tga->hdr.id_len		= tmp[ 0];
 	tga->hdr.map_t		= tmp[ 1];
 	tga->hdr.img_t		= tmp[ 2];
@@ -149,6 +191,7 @@ TGAReadHeader (TGA *tga)
 		return __TGA_LASTERR(tga);
 	}
 
+	__TGAKernel(tga, 0);
 	tga->last = TGA_OK;
 	return __TGA_LASTERR(tga);
 }
@@ -172,8 +215,8 @@ TGAReadImageId(TGA    *tga,
 		data->flags &= ~TGA_IMAGE_ID;
 		return __TGA_LASTERR(tga);
 	}
-	data->img_id = (tbyte*) realloc(data->img_id, tga->hdr.id_len);
-	if (!data->img_id) {
+	if (!__TGAReserve(data, &data->img_id, &data->img_id_size,
+			  tga->hdr.id_len)) {
 		data->flags &= ~TGA_IMAGE_ID;
 		TGA_ERROR(tga, TGA_OOM);
 		return __TGA_LASTERR(tga);
@@ -187,32 +230,7 @@ TGAReadImageId(TGA    *tga,
 
 	data->flags |= TGA_IMAGE_ID;
 	tga->last = TGA_OK;
-	return TGA_OK;
-}
-
-
-int
-convert_16_to_24(TGA *tga, tbyte *buf, size_t size_buf, tbyte **bufout)
-{
-	if (size_buf % 2) {
-		TGA_ERROR(tga, TGA_ERROR);
-		return __TGA_LASTERR(tga);
-	}
-	size_t new_size = size_buf + size_buf / 2;
-
-	tbyte *newbuf = (tbyte *) malloc(new_size);
-	if (!newbuf) {
-		TGA_ERROR(tga, TGA_OOM);
-		return __TGA_LASTERR(tga);
-	}
-
-	for(size_t buf_i = size_buf, newbuf_i = new_size; buf_i != 0; buf_i -= 2, newbuf_i -= 3) {
-		tlong tmp = buf[buf_i - 2] + buf[buf_i - 1] * 256;
-		newbuf[newbuf_i - 3] = (tmp >> 10) & 0x1F;
-		newbuf[newbuf_i - 2] = (tmp >> 5) & 0x1F;
-		newbuf[newbuf_i - 1] = (tmp >> 5) & 0x1F;
-	}
-	*bufout = newbuf;
+	TGA_TRACE_EVENT(IMAGE_ID, tga, 0, 0, 0, tga->hdr.id_len);
 	return TGA_OK;
 }
 
@@ -223,7 +241,7 @@ TGAReadColorMap (TGA 	  *tga,
 {
 	if (!tga) return TGA_ERROR;
 
-	tlong n = TGA_CMAP_SIZE(tga);
+	size_t n = TGA_CMAP_SIZE(tga);
 	if (n == 0) {
 		if (data) {
 			data->flags &= ~TGA_COLOR_MAP;
@@ -236,7 +254,7 @@ TGAReadColorMap (TGA 	  *tga,
 		return __TGA_LASTERR(tga);
 	}
 
-	tlong off = TGA_CMAP_OFF(tga);
+	tuint64 off = TGA_CMAP_OFF(tga);
 	if (tga->off != off) {
 		__TGASeek(tga, off, SEEK_SET);
 		if (!__TGA_SUCCEEDED(tga)) {
@@ -245,8 +263,9 @@ TGAReadColorMap (TGA 	  *tga,
 		}
 	}
 
-	data->cmap = (tbyte*) realloc(data->cmap, n);
-	if (!data->cmap) {
+	const TGAKernel *k = __TGASelectKernel(tga->hdr.map_entry, data->flags);
+	if (!__TGAReserve(data, &data->cmap, &data->cmap_size,
+			  k ? n / k->sample_bytes * k->out_bytes : n)) {
 		data->flags &= ~TGA_COLOR_MAP;
 		TGA_ERROR(tga, TGA_OOM);
 		return __TGA_LASTERR(tga);
@@ -258,23 +277,13 @@ TGAReadColorMap (TGA 	  *tga,
 		return __TGA_LASTERR(tga);
 	}
 
-	if (TGA_CAN_SWAP(tga->hdr.map_entry) && (data->flags & TGA_RGB)) {
-		__TGAbgr2rgb(data->cmap, n, tga->hdr.map_entry / 8);
-	}
-
-	if (tga->hdr.map_entry == 15 || tga->hdr.map_entry == 16) {
-		tbyte *newcmap;
-		convert_16_to_24(tga, data->cmap, read, &newcmap);
-		if (!__TGA_SUCCEEDED(tga)) {
-			data->flags &= ~TGA_COLOR_MAP;
-			return __TGA_LASTERR(tga);
-		}
-		free(data->cmap);
-		data->cmap = newcmap;
+	if (k && k->convert) {
+		k->convert(data->cmap, data->cmap, n / k->sample_bytes);
 	}
 
 	data->flags |= TGA_COLOR_MAP;
 	tga->last = TGA_OK;
+	TGA_TRACE_EVENT(COLOR_MAP, tga, 0, 0, 0, n);
 	return read;
 }
 
@@ -288,42 +297,12 @@ TGAReadRLE(TGA   *tga,
 		return __TGA_LASTERR(tga);
 	}
 
-	tbyte packet_head;
-	const tbyte sample_bytes = tga->hdr.depth / 8;
-	tbyte sample[sample_bytes];
-	tbyte repetition = 0;
-	tbyte raw = 0;
-
-	for (tshort x = 0; x < tga->hdr.width; ++x) {
-		if (repetition == 0 && raw == 0) {
-			TGARead(tga, &packet_head, 1, 1);
-			if (packet_head & 0x80) {
-				repetition = 1 + (packet_head & 0x7f);
-				TGARead(tga, sample, sample_bytes, 1);
-			} else {
-				raw = packet_head + 1;
-			}
-		}
-		if (repetition > 0) {
-			for (tbyte k = 0; k < sample_bytes; ++k) {
-				buf[k] = sample[k];
-			}
-			--repetition;
-		} else {
-			TGARead(tga, sample, sample_bytes, 1);
-			for (tbyte k = 0; k < sample_bytes; ++k) {
-				buf[k] = sample[k];
-			}
-			--raw;
-		}
-		buf += sample_bytes;
-	}
-
-	if (repetition || raw) { //FIXME: TGA v1 does allow cross scanline RLE
-		TGA_ERROR(tga, TGA_ERROR);
+	const TGAKernel *k = __TGAKernel(tga, 0);
+	if (!k) {
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return __TGA_LASTERR(tga);
 	}
-
-	return __TGA_LASTERR(tga);;
+	return k->read_rle(tga, buf);
 }
 
 int
@@ -342,8 +321,21 @@ TGAReadScanlines(TGA	 *tga,
 		return __TGA_LASTERR(tga);
 	}
 
-	data->img_data = (tbyte*) realloc(data->img_data, TGA_IMG_DATA_SIZE(tga));
-	if (!data->img_data) {
+	const TGAKernel *k = __TGAKernel(tga, data->flags);
+	if (!k) {
+		data->flags &= ~TGA_IMAGE_DATA;
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return __TGA_LASTERR(tga);
+	}
+
+	const tuint64 size = TGA_IMG_DATA_SIZE(tga) / k->sample_bytes *
+		k->out_bytes;
+	if (__TGACheckLimits(tga, __TGAMinFileSize(tga, 0), size) != TGA_OK) {
+		data->flags &= ~TGA_IMAGE_DATA;
+		return __TGA_LASTERR(tga);
+	}
+	if (!TGA_SIZE_OK(size) || !__TGAReserve(data, &data->img_data,
+			&data->img_data_size, size)) {
 		data->flags &= ~TGA_IMAGE_DATA;
 		TGA_ERROR(tga, TGA_OOM);
 		return __TGA_LASTERR(tga);
@@ -352,7 +344,7 @@ TGAReadScanlines(TGA	 *tga,
 	size_t sln_start = 0;
 	size_t sln_stop = tga->hdr.height;
 	size_t sln_size = TGA_SCANLINE_SIZE(tga);
-	tlong off = TGA_IMG_DATA_OFF(tga) + (sln_start * sln_size);
+	tuint64 off = TGA_IMG_DATA_OFF(tga) + (sln_start * sln_size);
 
 	if (tga->off != off) {
 		__TGASeek(tga, off, SEEK_SET);
@@ -361,41 +353,452 @@ TGAReadScanlines(TGA	 *tga,
 		}
 	}
 
-	if (TGA_IMGTYPE_IS_ENCODED(tga)) {
-		for(size_t sln_i = sln_start; sln_i < sln_stop; ++sln_i) {
-			TGAReadRLE(tga, data->img_data + (sln_i * sln_size));
+	const int widen = k->out_bytes != k->sample_bytes;
+	const int stats = (data->flags & TGA_STATS) && data->stats;
+	const int encoded = TGA_IMGTYPE_IS_ENCODED(tga);
+	const size_t out_size = (size_t) tga->hdr.width * k->out_bytes;
+	TGAStatsCtx ctx;
+
+	if (stats) {
+		__TGAStatsBegin(&ctx, data->stats, k->out_bytes,
+			tga->hdr.depth == 32 && TGA_IMGTYPE_IS_TRUEC(tga));
+	}
+
+	/* Decode a band of scanlines, then convert and gather statistics per
+	 * scanline while it is in cache. Widened rows are read one at a time
+	 * to their final offset and converted in place from the back. */
+	size_t band = widen || encoded ? 1 : READ_BAND_BYTES / sln_size;
+	if (band == 0) band = 1;
+	for (size_t sln_i = sln_start; sln_i < sln_stop; sln_i += band) {
+		const size_t n = sln_stop - sln_i < band ? sln_stop - sln_i : band;
+		tbyte *line = data->img_data + sln_i * out_size;
+		if (encoded) {
+			k->read_rle(tga, line);
+		} else {
+			TGARead(tga, line, sln_size, n);
+		}
+		if (!__TGA_SUCCEEDED(tga)) {
+			data->flags &= ~TGA_IMAGE_DATA;
+			return __TGA_LASTERR(tga);
+		}
+		for (size_t r = 0; r < n; ++r, line += out_size) {
+			if (k->convert) {
+				k->convert(line, line, tga->hdr.width);
+			}
+			if (stats) {
+				__TGAStatsUpdate(&ctx, line, out_size);
+			}
+		}
+	}
+	TGA_TRACE_EVENT(ROWS, tga, 0, sln_start, sln_stop - sln_start,
+		tga->off - off);
+
+	if (stats) {
+		__TGAStatsEnd(&ctx);
+	}
+	if (k->convert) {
+		TGA_TRACE_EVENT(CONVERT, tga, 0, sln_start, sln_stop - sln_start,
+			(sln_stop - sln_start) * out_size);
+	}
+	if (widen) {
+		tga->hdr.depth = 24; //FIXME: do not change tga
+	}
+
+	return TGA_OK;
+}
+
+
+void
+__TGAScaleAccumulate(tuint32	 *acc,
+		     const tbyte *row,
+		     size_t	  width,
+		     size_t	  sample_bytes,
+		     size_t	  channels,
+		     size_t	  scale)
+{
+	tbyte px[3];
+	for (size_t x = 0; x < width; ++x) {
+		tuint32 *dst = acc + (x / scale) * channels;
+		const tbyte *src = row + x * sample_bytes;
+		if (channels != sample_bytes) {
+			__TGAunpack16(src, px);
+			src = px;
+		}
+		for (size_t c = 0; c < channels; ++c) {
+			dst[c] += src[c];
+		}
+	}
+}
+
+
+void
+__TGAScaleAverage(tuint32 *acc,
+		  tbyte	  *out,
+		  size_t   width,
+		  size_t   channels,
+		  size_t   scale,
+		  size_t   rows)
+{
+	const size_t out_width = TGA_SCALED_DIM(width, scale);
+	for (size_t x = 0; x < out_width; ++x) {
+		size_t cols = width - x * scale;
+		if (cols > scale) cols = scale;
+		const tuint32 n = cols * rows;
+		for (size_t c = 0; c < channels; ++c) {
+			size_t i = x * channels + c;
+			out[i] = (acc[i] + n / 2) / n;
+			acc[i] = 0;
+		}
+	}
+}
+
+
+int
+TGAReadScanlinesScaled(TGA     *tga,
+		       TGAData *data,
+		       tuint8   scale)
+{
+	if (!tga) return TGA_ERROR;
+
+	if (!data || scale == 0) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+
+	if (scale == 1 || !TGA_IMGTYPE_AVAILABLE(tga)) {
+		return TGAReadScanlines(tga, data);
+	}
+
+	const TGAKernel *k = __TGAKernel(tga, data->flags);
+	if (!k) {
+		data->flags &= ~TGA_IMAGE_DATA;
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return __TGA_LASTERR(tga);
+	}
+
+	const size_t sample_bytes = k->sample_bytes;
+	const size_t channels = k->out_bytes;
+	const size_t width = TGA_SCALED_DIM(tga->hdr.width, scale);
+	const size_t height = TGA_SCALED_DIM(tga->hdr.height, scale);
+	const size_t sln_size = TGA_SCANLINE_SIZE(tga);
+	const size_t out_size = width * channels;
+	const int mapped = TGA_IMGTYPE_IS_MAPPED(tga);
+
+	if (__TGACheckLimits(tga, __TGAMinFileSize(tga, 0), (tuint64) out_size *
+			(height + sizeof(tuint32)) + sln_size) != TGA_OK) {
+		data->flags &= ~TGA_IMAGE_DATA;
+		return __TGA_LASTERR(tga);
+	}
+
+	tbyte *row = (tbyte*) malloc(sln_size);
+	tuint32 *acc = (tuint32*) calloc(out_size, sizeof(tuint32));
+	if (!row || !acc || !TGA_SIZE_OK((tuint64) out_size * height) ||
+	    !__TGAReserve(data, &data->img_data, &data->img_data_size,
+			  out_size * height)) {
+		free(row);
+		free(acc);
+		data->flags &= ~TGA_IMAGE_DATA;
+		TGA_ERROR(tga, TGA_OOM);
+		return __TGA_LASTERR(tga);
+	}
+
+	tuint64 off = TGA_IMG_DATA_OFF(tga);
+	if (tga->off != off) {
+		__TGASeek(tga, off, SEEK_SET);
+	}
+
+	/* Source rows are folded into the accumulator one band at a time,
+	 * so only a single full-resolution scanline is ever held.
+	 * Colormap indices cannot be averaged and are point-sampled. */
+	tbyte *out = data->img_data;
+	for (size_t y = 0; y < tga->hdr.height && __TGA_SUCCEEDED(tga); ++y) {
+		if (TGA_IMGTYPE_IS_ENCODED(tga)) {
+			k->read_rle(tga, row);
+		} else {
+			TGARead(tga, row, sln_size, 1);
+		}
+		if (!__TGA_SUCCEEDED(tga)) {
+			break;
+		}
+
+		const size_t band_y = y % scale;
+		if (mapped) {
+			if (band_y == 0) {
+				for (size_t x = 0; x < width; ++x) {
+					out[x] = row[x * scale];
+				}
+			}
+		} else {
+			__TGAScaleAccumulate(acc, row, tga->hdr.width,
+				sample_bytes, channels, scale);
+		}
+
+		if (band_y == (size_t) scale - 1 || y + 1 == tga->hdr.height) {
+			if (!mapped) {
+				__TGAScaleAverage(acc, out, tga->hdr.width,
+					channels, scale, band_y + 1);
+			}
+			out += out_size;
+		}
+	}
+
+	free(row);
+	free(acc);
+	if (!__TGA_SUCCEEDED(tga)) {
+		data->flags &= ~TGA_IMAGE_DATA;
+		return __TGA_LASTERR(tga);
+	}
+
+	TGA_TRACE_EVENT(ROWS, tga, 0, 0, tga->hdr.height, tga->off - off);
+	if (k->swap) {
+		k->swap(data->img_data, data->img_data, width * height);
+		TGA_TRACE_EVENT(CONVERT, tga, 0, 0, height, out_size * height);
+	}
+
+	return TGA_OK;
+}
+
+
+int
+TGAReadScanline(TGA	*tga,
+		tbyte	*line,
+		tuint32  flags)
+{
+	if (!tga) return TGA_ERROR;
+	if (!line || !TGA_IMGTYPE_AVAILABLE(tga) || tga->row >= tga->hdr.height) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+
+	const TGAKernel *k = __TGAKernel(tga, flags);
+	if (!k) {
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return __TGA_LASTERR(tga);
+	}
+
+	if (tga->row == 0) {
+		tuint64 off = TGA_IMG_DATA_OFF(tga);
+		if (tga->off != off) {
+			__TGASeek(tga, off, SEEK_SET);
 			if (!__TGA_SUCCEEDED(tga)) {
-				data->flags &= ~TGA_IMAGE_DATA;
 				return __TGA_LASTERR(tga);
 			}
 		}
-		tga->hdr.img_t &= ~0x8; //FIXME: remove (TGA represents file)
+	}
+
+	const tuint64 start = tga->off;
+	if (TGA_IMGTYPE_IS_ENCODED(tga)) {
+		k->read_rle(tga, line);
 	} else {
-		TGARead(tga, data->img_data + (sln_start * sln_size),
-			sln_size, sln_stop - sln_start);
+		TGARead(tga, line, TGA_SCANLINE_SIZE(tga), 1);
+	}
+	if (!__TGA_SUCCEEDED(tga)) {
+		return __TGA_LASTERR(tga);
+	}
+	TGA_TRACE_EVENT(ROWS, tga, 0, tga->row, 1, tga->off - start);
+
+	if (k->convert) {
+		k->convert(line, line, tga->hdr.width);
+		TGA_TRACE_EVENT(CONVERT, tga, 0, tga->row, 1,
+			tga->hdr.width * k->out_bytes);
+	}
+
+	++tga->row;
+	return TGA_OK;
+}
+
+
+size_t
+TGAScanlineSize(const TGA *tga)
+{
+	if (!tga) return 0;
+	if (tga->hdr.depth == 15 || tga->hdr.depth == 16) {
+		return (size_t) tga->hdr.width * 3;
+	}
+	return TGA_SCANLINE_SIZE(tga);
+}
+
+
+int
+TGAReadScanlinesInto(TGA     *tga,
+		     tbyte   *dst,
+		     size_t   row_pitch,
+		     tuint32  flags)
+{
+	if (!tga) return TGA_ERROR;
+	if (!dst || !TGA_IMGTYPE_AVAILABLE(tga) ||
+	    row_pitch < TGAScanlineSize(tga)) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+	if (__TGACheckLimits(tga, __TGAMinFileSize(tga, 0), 0) != TGA_OK) {
+		return __TGA_LASTERR(tga);
+	}
+
+	tga->row = 0;
+	const size_t sln_size = TGA_SCANLINE_SIZE(tga);
+	if (TGA_IMGTYPE_IS_ENCODED(tga) || row_pitch != sln_size ||
+	    tga->hdr.depth == 15 || tga->hdr.depth == 16) {
+		for (size_t y = 0; y < tga->hdr.height; ++y) {
+			TGAReadScanline(tga, dst + y * row_pitch, flags);
+			if (!__TGA_SUCCEEDED(tga)) {
+				return __TGA_LASTERR(tga);
+			}
+		}
+		return TGA_OK;
+	}
+
+	/* tightly packed raw image: one read for all scanlines */
+	tuint64 off = TGA_IMG_DATA_OFF(tga);
+	if (tga->off != off) {
+		__TGASeek(tga, off, SEEK_SET);
 		if (!__TGA_SUCCEEDED(tga)) {
 			return __TGA_LASTERR(tga);
 		}
 	}
+	TGARead(tga, dst, sln_size, tga->hdr.height);
+	if (!__TGA_SUCCEEDED(tga)) {
+		return __TGA_LASTERR(tga);
+	}
+	TGA_TRACE_EVENT(ROWS, tga, 0, 0, tga->hdr.height,
+		sln_size * tga->hdr.height);
+	const TGAKernel *k = __TGAKernel(tga, flags);
+	if (k && k->convert) {
+		k->convert(dst, dst, (size_t) tga->hdr.width * tga->hdr.height);
+		TGA_TRACE_EVENT(CONVERT, tga, 0, 0, tga->hdr.height,
+			sln_size * tga->hdr.height);
+	}
+	tga->row = tga->hdr.height;
+	return TGA_OK;
+}
+
+
+static tlong
+get_le32(const tbyte *buf)
+{
+	return buf[0] + (buf[1] << 8) + ((tlong) buf[2] << 16) + ((tlong) buf[3] << 24);
+}
 
-	if (TGA_CAN_SWAP(tga->hdr.depth) && (data->flags & TGA_RGB)) {
-		__TGAbgr2rgb(data->img_data + (sln_start * sln_size),
-			sln_size * (sln_stop - sln_start),
-			tga->hdr.depth / 8);
+
+void
+TGAFreePostageStamp(TGAStamp *stamp)
+{
+	if (stamp->data)
+		free(stamp->data);
+	stamp->data = 0;
+	stamp->width = 0;
+	stamp->height = 0;
+}
+
+
+int
+TGAReadPostageStamp(TGA      *tga,
+		    TGAStamp *stamp,
+		    tuint32   flags)
+{
+	if (!tga) return TGA_ERROR;
+	if (!stamp) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
 	}
 
-	if (tga->hdr.depth == 15 || tga->hdr.depth == 16) {
-		tbyte *new_img;
-		convert_16_to_24(tga, data->img_data + (sln_start * sln_size),
-			(sln_stop - sln_start) * sln_size, &new_img);
+	stamp->width = 0;
+	stamp->height = 0;
+	stamp->depth = 0;
+	stamp->data = (tbyte *) 0;
+
+	tuint64 size = __TGASeek(tga, 0, SEEK_END);
+	if (!__TGA_SUCCEEDED(tga)) {
+		return __TGA_LASTERR(tga);
+	}
+
+	/* The extension area is normally right in front of the footer, so
+	 * read both with one tail read. */
+	tbyte tail[TGA_EXT_SIZE + TGA_FOOTER_SIZE];
+	size_t tail_size = sizeof(tail) < size ? sizeof(tail) : size;
+	if (tail_size < TGA_HEADER_SIZE + TGA_FOOTER_SIZE) {
+		return TGA_OK;
+	}
+	tuint64 tail_off = size - tail_size;
+	__TGASeek(tga, tail_off, SEEK_SET);
+	TGARead(tga, tail, tail_size, 1);
+	if (!__TGA_SUCCEEDED(tga)) {
+		return __TGA_LASTERR(tga);
+	}
+
+	const tbyte *footer = tail + tail_size - TGA_FOOTER_SIZE;
+	if (memcmp(footer + 8, TGA_SIGNATURE, sizeof(TGA_SIGNATURE))) {
+		return TGA_OK;
+	}
+
+	tuint64 ext_off = get_le32(footer);
+	if (ext_off == 0) {
+		return TGA_OK;
+	}
+	if (ext_off + TGA_EXT_STAMP_OFF + 4 > size - TGA_FOOTER_SIZE) {
+		TGA_ERROR(tga, TGA_TRUNCATED);
+		return __TGA_LASTERR(tga);
+	}
+
+	tbyte field[4];
+	const tbyte *stamp_field = field;
+	if (ext_off >= tail_off) {
+		stamp_field = tail + (ext_off - tail_off) + TGA_EXT_STAMP_OFF;
+	} else {
+		__TGASeek(tga, ext_off + TGA_EXT_STAMP_OFF, SEEK_SET);
+		TGARead(tga, field, 4, 1);
 		if (!__TGA_SUCCEEDED(tga)) {
-			data->flags &= ~TGA_COLOR_MAP;
 			return __TGA_LASTERR(tga);
 		}
-		tga->hdr.depth = 24; //FIXME: do not change tga
-		free(data->img_data);
-		data->img_data = new_img;
 	}
 
+	tuint64 stamp_off = get_le32(stamp_field);
+	if (stamp_off == 0) {
+		return TGA_OK;
+	}
+	if (stamp_off + 2 > size) {
+		TGA_ERROR(tga, TGA_TRUNCATED);
+		return __TGA_LASTERR(tga);
+	}
+
+	tbyte dim[2];
+	__TGASeek(tga, stamp_off, SEEK_SET);
+	TGARead(tga, dim, 2, 1);
+	if (!__TGA_SUCCEEDED(tga)) {
+		return __TGA_LASTERR(tga);
+	}
+
+	const size_t sample_bytes = TGA_PIXEL_SIZE(tga->hdr.depth);
+	const size_t n = (size_t) dim[0] * dim[1];
+	if (n == 0) {
+		return TGA_OK;
+	}
+	if (stamp_off + 2 + n * sample_bytes > size) {
+		TGA_ERROR(tga, TGA_TRUNCATED);
+		return __TGA_LASTERR(tga);
+	}
+	const int unpack = tga->hdr.depth == 15 || tga->hdr.depth == 16;
+	stamp->data = (tbyte*) malloc(n * (unpack ? 3 : sample_bytes));
+	if (!stamp->data) {
+		TGA_ERROR(tga, TGA_OOM);
+		return __TGA_LASTERR(tga);
+	}
+
+	TGARead(tga, stamp->data, sample_bytes, n);
+	if (!__TGA_SUCCEEDED(tga)) {
+		TGAFreePostageStamp(stamp);
+		return __TGA_LASTERR(tga);
+	}
+
+	if (TGA_CAN_SWAP(tga->hdr.depth) && (flags & TGA_RGB)) {
+		__TGAbgr2rgb(stamp->data, n * sample_bytes, sample_bytes);
+	}
+	if (unpack) {
+		__TGAunpack16row(stamp->data, n);
+	}
+
+	stamp->width = dim[0];
+	stamp->height = dim[1];
+	stamp->depth = unpack ? 24 : tga->hdr.depth;
 	return TGA_OK;
 }
@@ -0,0 +1,253 @@
+/*
+ *  tgastats.c - Pixel statistics computed while decoding
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <tga.h>
+#include "tga_private.h"
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+static tuint64
+get_le64(const tbyte *p)
+{
+	tuint64 v = 0;
+	for (int i = 7; i >= 0; --i) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+
+static tuint64
+xxh_round(tuint64 acc,
+	  tuint64 input)
+{
+	acc += input * XXH_P2;
+	acc = ROTL64(acc, 31);
+	return acc * XXH_P1;
+}
+
+
+static tuint64
+xxh_merge(tuint64 h,
+	  tuint64 lane)
+{
+	h ^= xxh_round(0, lane);
+	return h * XXH_P1 + XXH_P4;
+}
+
+
+/* Consume whole 32 byte stripes of p, returns the bytes consumed. */
+static size_t
+xxh_stripes(TGAStatsCtx *ctx,
+	    const tbyte *p,
+	    size_t	 n)
+{
+	size_t pos = 0;
+	for (; pos + 32 <= n; pos += 32) {
+		ctx->lane[0] = xxh_round(ctx->lane[0], get_le64(p + pos));
+		ctx->lane[1] = xxh_round(ctx->lane[1], get_le64(p + pos + 8));
+		ctx->lane[2] = xxh_round(ctx->lane[2], get_le64(p + pos + 16));
+		ctx->lane[3] = xxh_round(ctx->lane[3], get_le64(p + pos + 24));
+	}
+	return pos;
+}
+
+
+static void
+xxh_update(TGAStatsCtx *ctx,
+	   const tbyte *p,
+	   size_t	n)
+{
+	if (ctx->buf_fill) {
+		size_t take = 32 - ctx->buf_fill < n ? 32 - ctx->buf_fill : n;
+		memcpy(ctx->buf + ctx->buf_fill, p, take);
+		ctx->buf_fill += take;
+		p += take;
+		n -= take;
+		if (ctx->buf_fill < 32) {
+			return;
+		}
+		xxh_stripes(ctx, ctx->buf, 32);
+		ctx->buf_fill = 0;
+	}
+	size_t done = xxh_stripes(ctx, p, n);
+	memcpy(ctx->buf, p + done, n - done);
+	ctx->buf_fill = n - done;
+}
+
+
+static tuint64
+xxh_digest(const TGAStatsCtx *ctx)
+{
+	tuint64 h;
+	if (ctx->total >= 32) {
+		h = ROTL64(ctx->lane[0], 1) + ROTL64(ctx->lane[1], 7) +
+			ROTL64(ctx->lane[2], 12) + ROTL64(ctx->lane[3], 18);
+		for (int i = 0; i < 4; ++i) {
+			h = xxh_merge(h, ctx->lane[i]);
+		}
+	} else {
+		h = XXH_P5;
+	}
+	h += ctx->total;
+
+	const tbyte *p = ctx->buf;
+	size_t n = ctx->buf_fill;
+	for (; n >= 8; p += 8, n -= 8) {
+		h ^= xxh_round(0, get_le64(p));
+		h = ROTL64(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (n >= 4) {
+		tuint64 k = p[0] | (p[1] << 8) | ((tuint64) p[2] << 16) |
+			((tuint64) p[3] << 24);
+		h ^= k * XXH_P1;
+		h = ROTL64(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+		n -= 4;
+	}
+	for (; n > 0; ++p, --n) {
+		h ^= *p * XXH_P5;
+		h = ROTL64(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+void
+__TGAStatsBegin(TGAStatsCtx *ctx,
+		TGAStats    *stats,
+		size_t	     channels,
+		int	     alpha)
+{
+	tuint32 want = stats->want;
+	bzero(stats, sizeof(TGAStats));
+	stats->want = want;
+	stats->channels = channels;
+	stats->alpha_opaque = 1;
+	stats->alpha_binary = 1;
+	memset(stats->min, 0xff, sizeof(stats->min));
+
+	ctx->out = stats;
+	ctx->channels = channels;
+	ctx->alpha = alpha && channels == 4;
+	ctx->lane[0] = XXH_P1 + XXH_P2;
+	ctx->lane[1] = XXH_P2;
+	ctx->lane[2] = 0;
+	ctx->lane[3] = -XXH_P1;
+	ctx->buf_fill = 0;
+	ctx->total = 0;
+
+	if (want & TGA_STATS_CRC32) {
+		for (tuint32 i = 0; i < 256; ++i) {
+			tuint32 c = i;
+			for (int k = 0; k < 8; ++k) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			ctx->crc_table[i] = c;
+		}
+		stats->crc32 = 0xFFFFFFFFu;
+	}
+}
+
+
+void
+__TGAStatsUpdate(TGAStatsCtx *ctx,
+		 const tbyte *line,
+		 size_t	      size)
+{
+	TGAStats *st = ctx->out;
+	const size_t ch = ctx->channels;
+
+	ctx->total += size;
+	if (st->want & TGA_STATS_XXH64) {
+		xxh_update(ctx, line, size);
+	}
+
+	if (st->want & TGA_STATS_CRC32) {
+		tuint32 crc = st->crc32;
+		for (size_t i = 0; i < size; ++i) {
+			crc = ctx->crc_table[(crc ^ line[i]) & 0xff] ^ (crc >> 8);
+		}
+		st->crc32 = crc;
+	}
+
+	if (st->want & TGA_STATS_HISTOGRAM) {
+		for (size_t i = 0; i + ch <= size; i += ch) {
+			for (size_t c = 0; c < ch; ++c) {
+				st->hist[c][line[i + c]] += 1;
+			}
+		}
+	}
+
+	if (st->want & TGA_STATS_MINMAX) {
+		for (size_t i = 0; i + ch <= size; i += ch) {
+			for (size_t c = 0; c < ch; ++c) {
+				if (line[i + c] < st->min[c]) st->min[c] = line[i + c];
+				if (line[i + c] > st->max[c]) st->max[c] = line[i + c];
+			}
+		}
+	}
+
+	if ((st->want & TGA_STATS_ALPHA) && ctx->alpha && st->alpha_binary) {
+		int opaque = st->alpha_opaque;
+		int binary = 1;
+		for (size_t i = 3; i < size; i += 4) {
+			opaque &= line[i] == 0xff;
+			binary &= line[i] == 0xff || line[i] == 0;
+		}
+		st->alpha_opaque = opaque;
+		st->alpha_binary = binary;
+	}
+}
+
+
+void
+__TGAStatsEnd(TGAStatsCtx *ctx)
+{
+	TGAStats *st = ctx->out;
+	if (st->want & TGA_STATS_XXH64) {
+		st->xxh64 = xxh_digest(ctx);
+	}
+	if (st->want & TGA_STATS_CRC32) {
+		st->crc32 ^= 0xFFFFFFFFu;
+	}
+	/* channels that saw no pixels report 0..0 */
+	for (size_t c = 0; c < 4; ++c) {
+		if (c >= ctx->channels || ctx->total == 0) {
+			st->min[c] = 0;
+		}
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ *  tgatrace.c - Trace hooks at decode and encode stage boundaries
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <tga.h>
+#include "tga_private.h"
+
+#ifdef TGA_TRACE
+TGATraceProc __TGATraceProc = NULL;
+void *__TGATraceUser = NULL;
+#endif
+
+
+void
+TGASetTraceProc(TGATraceProc  proc,
+		void	     *user)
+{
+#ifdef TGA_TRACE
+	__TGATraceProc = proc;
+	__TGATraceUser = user;
+#else
+	(void) proc;
+	(void) user;
+#endif
+}
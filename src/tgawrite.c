@@ -29,6 +29,13 @@
 #define LSB_SH(SHORT) ((SHORT) & 0xff)
 #define MSB_SH(SHORT) ((SHORT) >> 8)
 
+/* scanlines TGA_AUTO_ENCODE looks at */
+#define ESTIMATE_ROWS 64
+
+static int write_header(TGA *tga);
+
+static int write_extension(TGA *tga, TGAData *data);
+
 size_t
 TGAWrite(TGA 	     *tga, 
 	 const tbyte *buf, 
@@ -39,16 +46,95 @@ TGAWrite(TGA 	     *tga,
 	if (wrote != n) {
 		TGA_ERROR(tga, TGA_WRITE_FAIL);
 	}
-	tga->off = ftell(tga->fd);
+	tga->off += wrote * size;
 	return wrote;
 }
 
 
+static int
+write_image_sequential(TGA     *tga,
+		       TGAData *data)
+{
+	TGAWriteBegin(tga, data);
+	if (!__TGA_SUCCEEDED(tga)) {
+		return __TGA_LASTERR(tga);
+	}
+
+	if (!(data->flags & TGA_IMAGE_DATA)) {
+		/* header and image id only, like the seekable writer */
+		if (fflush(tga->fd)) {
+			TGA_ERROR(tga, TGA_WRITE_FAIL);
+		}
+		return __TGA_LASTERR(tga);
+	}
+
+	if (TGA_IMGTYPE_AVAILABLE(tga)) {
+		if (!data->img_data) {
+			TGA_ERROR(tga, TGA_ERROR);
+			return __TGA_LASTERR(tga);
+		}
+		size_t sln_size = TGA_SCANLINE_SIZE(tga);
+		for (size_t sln_i = 0; sln_i < tga->hdr.height; ++sln_i) {
+			TGAWriteScanline(tga, data->img_data + (sln_i * sln_size),
+				data->flags);
+			if (!__TGA_SUCCEEDED(tga)) {
+				return __TGA_LASTERR(tga);
+			}
+		}
+	}
+
+	if (data->flags & TGA_POSTAGE_STAMP) {
+		write_extension(tga, data);
+		if (!__TGA_SUCCEEDED(tga)) {
+			return __TGA_LASTERR(tga);
+		}
+	}
+
+	return TGAWriteEnd(tga);
+}
+
+
+/* Resolve TGA_AUTO_ENCODE into TGA_RLE_ENCODE. RLE is slower to write
+ * and read, so it is only picked when it saves a noticeable amount. */
+static void
+choose_encoding(TGA	*tga,
+		TGAData *data)
+{
+	if (!TGA_IMGTYPE_AVAILABLE(tga) || !data->img_data ||
+	    tga->hdr.height == 0) {
+		return;
+	}
+
+	TGAEstimate est;
+	tuint32 step = (tga->hdr.height + ESTIMATE_ROWS - 1) / ESTIMATE_ROWS;
+	if (TGAEstimateRLE(tga, data, step, &est) != TGA_OK) {
+		return;
+	}
+	if (est.rle_size < est.raw_size - est.raw_size / 16) {
+		data->flags |= TGA_RLE_ENCODE;
+	} else {
+		data->flags &= ~TGA_RLE_ENCODE;
+	}
+}
+
+
 int TGAWriteImage(TGA 	  *tga, 
 		  TGAData *data)
 {
 	if (!tga) return TGA_ERROR;
 
+	if ((data->flags & TGA_AUTO_ENCODE) && (data->flags & TGA_IMAGE_DATA)) {
+		choose_encoding(tga, data);
+	}
+
+	if (data->flags & TGA_WRITEV) {
+		return __TGAWriteImageV(tga, data);
+	}
+
+	if (!tga->seekable) {
+		return write_image_sequential(tga, data);
+	}
+
 	if (data->flags & TGA_IMAGE_ID) {
 		TGAWriteImageId(tga, data);
 		if (!__TGA_SUCCEEDED(tga)) {
@@ -66,6 +152,13 @@ int TGAWriteImage(TGA 	  *tga,
 		if (!__TGA_SUCCEEDED(tga)) {
 			return __TGA_LASTERR(tga);
 		}
+
+		if (data->flags & TGA_POSTAGE_STAMP) {
+			write_extension(tga, data);
+			if (!__TGA_SUCCEEDED(tga)) {
+				return __TGA_LASTERR(tga);
+			}
+		}
 	}
 
 	TGAWriteHeader(tga);
@@ -77,6 +170,79 @@ int TGAWriteImage(TGA 	  *tga,
 }
 
 
+
+/* Bytes TGAWriteRLE emits for one scanline: runs of two or more equal
+ * samples become run packets, everything else goes into raw packets. */
+static tuint64
+rle_line_size(const tbyte *line,
+	      size_t	   width,
+	      size_t	   sample_bytes)
+{
+	tuint64 size = 0;
+	size_t raw = 0;
+	for (size_t x = 0; x < width;) {
+		const tbyte *sample = line + x * sample_bytes;
+		size_t n = 1;
+		while (x + n < width &&
+		       !memcmp(sample, sample + n * sample_bytes, sample_bytes)) {
+			++n;
+		}
+		if (n > 1) {
+			size += (raw + 127) / 128 + raw * sample_bytes;
+			size += (n + 127) / 128 * (1 + sample_bytes);
+			raw = 0;
+		} else {
+			raw += 1;
+		}
+		x += n;
+	}
+	return size + (raw + 127) / 128 + raw * sample_bytes;
+}
+
+
+int
+TGAEstimateRLE(TGA	     *tga,
+	       const TGAData *data,
+	       tuint32	      step,
+	       TGAEstimate   *est)
+{
+	if (!tga) return TGA_ERROR;
+	if (!data || !est) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+
+	bzero(est, sizeof(TGAEstimate));
+	if (!TGA_IMGTYPE_AVAILABLE(tga) || tga->hdr.height == 0) {
+		return TGA_OK;
+	}
+	if (!data->img_data) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+	if (step == 0) step = 1;
+
+	const size_t sample_bytes = TGA_PIXEL_SIZE(tga->hdr.depth);
+	const size_t sln_size = TGA_SCANLINE_SIZE(tga);
+	const int alpha = tga->hdr.depth == 32 && TGA_IMGTYPE_IS_TRUEC(tga);
+	tuint64 rle_size = 0;
+	tuint32 rows = 0;
+
+	est->opaque = alpha;
+	for (size_t y = 0; y < tga->hdr.height; y += step, ++rows) {
+		const tbyte *line = data->img_data + y * sln_size;
+		rle_size += rle_line_size(line, tga->hdr.width, sample_bytes);
+		for (size_t x = 3; est->opaque && x < sln_size; x += 4) {
+			est->opaque = line[x] == 0xff;
+		}
+	}
+
+	est->raw_size = TGA_IMG_DATA_SIZE(tga);
+	est->rle_size = rle_size * tga->hdr.height / rows;
+	return TGA_OK;
+}
+
+
 int
 TGAWriteHeader(TGA *tga)
 {
@@ -87,8 +253,14 @@ TGAWriteHeader(TGA *tga)
 		return __TGA_LASTERR(tga);
 	}
 
-	tbyte tmp[TGA_HEADER_SIZE];
+	return write_header(tga);
+}
 
+
+void
+__TGAPackHeader(const TGA *tga,
+		tbyte	  *tmp)
+{
 	if (tga->hdr.map_t != 0) {
 		tmp[1] = 1;
 		tmp[3] = LSB_SH(tga->hdr.map_first);
@@ -115,12 +287,22 @@ TGAWriteHeader(TGA *tga)
 	tmp[17] = tga->hdr.alpha;
 	tmp[17] |= (tga->hdr.horz << 4);
 	tmp[17] |= (tga->hdr.vert << 5);
+}
 
+
+static int
+write_header(TGA *tga)
+{
+	tbyte tmp[TGA_HEADER_SIZE];
+
+	__TGAPackHeader(tga, tmp);
 	TGAWrite(tga, tmp, TGA_HEADER_SIZE, 1);
 	if (!__TGA_SUCCEEDED(tga)) {
 		return __TGA_LASTERR(tga);
 	}
 
+	TGA_TRACE_EVENT(HEADER, tga, 1, 0, 0, TGA_HEADER_SIZE);
+	__TGAKernel(tga, 0);
 	return TGA_OK;
 }
 
@@ -154,6 +336,7 @@ TGAWriteImageId(TGA	*tga,
 		return __TGA_LASTERR(tga);
 	}
 
+	TGA_TRACE_EVENT(IMAGE_ID, tga, 1, 0, 0, tga->hdr.id_len);
 	return TGA_OK;
 }
 
@@ -168,7 +351,7 @@ TGAWriteColorMap(TGA     *tga,
 		return __TGA_LASTERR(tga);
 	}
 
-	tlong n = TGA_CMAP_SIZE(tga);
+	size_t n = TGA_CMAP_SIZE(tga);
 	if (n == 0) {
 		data->flags &= ~TGA_COLOR_MAP;
 		return TGA_OK;
@@ -181,7 +364,7 @@ TGAWriteColorMap(TGA     *tga,
 		data->flags &= ~TGA_RGB;
 	}
 
-	tlong off = TGA_CMAP_OFF(tga);
+	tuint64 off = TGA_CMAP_OFF(tga);
 	__TGASeek(tga, off, SEEK_SET);
 	if (!__TGA_SUCCEEDED(tga)) {
 		return __TGA_LASTERR(tga);
@@ -192,6 +375,7 @@ TGAWriteColorMap(TGA     *tga,
 		return __TGA_LASTERR(tga);
 	}
 
+	TGA_TRACE_EVENT(COLOR_MAP, tga, 1, 0, 0, n);
 	return TGA_OK;
 }
 
@@ -206,64 +390,12 @@ TGAWriteRLE(TGA   *tga,
 		return __TGA_LASTERR(tga);
 	}
 
-	const tbyte sample_bytes = tga->hdr.depth / 8;
-	tuint8 repetition = 0;
-	tuint8 raw = 0;
-	FILE *fd = tga->fd;
-
-	tuint8 *sample_start = buf;
-
-	for (tshort x = 1; x < tga->hdr.width; ++x) {
-		if (memcmp(buf, buf + sample_bytes, sample_bytes)) {
-			if (repetition) {
-				tbyte packet_head = repetition | 0x80;
-				TGAWrite(tga, &packet_head, 1, 1);
-				TGAWrite(tga, sample_start, sample_bytes, 1);
-				sample_start = buf + sample_bytes;
-				repetition = 0;
-				raw = 0;
-			} else {
-				raw += 1;
-			}
-		} else {
-			if (raw) {
-				tbyte packet_head = (raw - 1) | 0x00;
-				TGAWrite(tga, &packet_head, 1, 1);
-				TGAWrite(tga, sample_start, sample_bytes, raw);
-				sample_start = buf;
-				raw = 0;
-				repetition = 1;
-			} else {
-				repetition += 1;
-			}
-		}
-		if (repetition == 0x80) {
-			putc(255, fd);
-			fwrite(sample_start, sample_bytes, 1, fd);
-			sample_start = buf + sample_bytes;
-			raw = 0;
-			repetition = 0;
-		} else if (raw == 128) {
-			putc(127, fd);
-			fwrite(sample_start, sample_bytes, raw, fd);
-			sample_start = buf + sample_bytes;
-			raw = 0;
-			repetition = 0;
-		}
-		buf += sample_bytes;
-	}
-
-	if (repetition > 0) {
-		tbyte packet_head = repetition | 0x80;
-		TGAWrite(tga, &packet_head, 1, 1);
-		TGAWrite(tga, sample_start, sample_bytes, 1);
-	} else {
-		tbyte packet_head = raw | 0x00;
-		TGAWrite(tga, &packet_head, 1, 1);
-		TGAWrite(tga, sample_start, sample_bytes, raw + 1);
+	const TGAKernel *k = __TGAKernel(tga, 0);
+	if (!k) {
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return __TGA_LASTERR(tga);
 	}
-
-	return __TGA_LASTERR(tga);
+	return k->write_rle(tga, buf);
 }
 
 
@@ -282,10 +414,16 @@ TGAWriteScanlines(TGA	  *tga,
 		return __TGA_LASTERR(tga);
 	}
 
+	const TGAKernel *k = __TGAKernel(tga, data->flags);
+	if (!k) {
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return __TGA_LASTERR(tga);
+	}
+
 	size_t sln_start = 0;
 	size_t sln_stop = tga->hdr.height;
 	size_t sln_size = TGA_SCANLINE_SIZE(tga);
-	tlong off = TGA_IMG_DATA_OFF(tga) + (sln_start * sln_size);
+	tuint64 off = TGA_IMG_DATA_OFF(tga) + (sln_start * sln_size);
 
 	
 	if (tga->off != off) {
@@ -295,15 +433,17 @@ TGAWriteScanlines(TGA	  *tga,
 		}
 	}
 
-	if (TGA_CAN_SWAP(tga->hdr.depth) && (data->flags & TGA_RGB)) {
-		__TGAbgr2rgb(data->img_data + (sln_start * sln_size),
-			sln_size * (sln_stop - sln_start),
-			tga->hdr.depth / 8);
+	if (k->swap) {
+		k->swap(data->img_data + (sln_start * sln_size),
+			data->img_data + (sln_start * sln_size),
+			(size_t) tga->hdr.width * (sln_stop - sln_start));
+		TGA_TRACE_EVENT(CONVERT, tga, 1, sln_start, sln_stop - sln_start,
+			(sln_stop - sln_start) * sln_size);
 	}
 
 	if (data->flags & TGA_RLE_ENCODE) {
 		for(size_t sln_i = sln_start; sln_i < sln_stop; ++sln_i) {
-			TGAWriteRLE(tga, data->img_data + (sln_i * sln_size));
+			k->write_rle(tga, data->img_data + (sln_i * sln_size));
 			if (!__TGA_SUCCEEDED(tga)) {
 				data->flags &= ~TGA_IMAGE_DATA;
 				return __TGA_LASTERR(tga);
@@ -311,6 +451,7 @@ TGAWriteScanlines(TGA	  *tga,
 		}
 		tga->hdr.img_t |= 0x8; //FIXME: do not change tga
 	} else {
+		tga->hdr.img_t &= ~0x8;
 		TGAWrite(tga, data->img_data + (sln_start * sln_size),
 			sln_size, sln_stop - sln_start);
 		if (!__TGA_SUCCEEDED(tga)) {
@@ -318,5 +459,253 @@ TGAWriteScanlines(TGA	  *tga,
 		}
 	}
 
+	TGA_TRACE_EVENT(ROWS, tga, 1, sln_start, sln_stop - sln_start,
+		tga->off - off);
 	return TGA_OK;
 }
+
+
+int
+TGAWriteBegin(TGA     *tga,
+	      TGAData *data)
+{
+	if (!tga) return TGA_ERROR;
+	if (!data) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+
+	if ((data->flags & TGA_RLE_ENCODE) && TGA_IMGTYPE_AVAILABLE(tga)) {
+		tga->hdr.img_t |= 0x8;
+	} else {
+		tga->hdr.img_t &= ~0x8;
+	}
+
+	if (tga->off != 0) {
+		__TGASeek(tga, 0, SEEK_SET);
+		if (!__TGA_SUCCEEDED(tga)) {
+			return __TGA_LASTERR(tga);
+		}
+	}
+
+	write_header(tga);
+	if (!__TGA_SUCCEEDED(tga)) {
+		return __TGA_LASTERR(tga);
+	}
+
+	if (data->flags & TGA_IMAGE_ID) {
+		TGAWriteImageId(tga, data);
+		if (!__TGA_SUCCEEDED(tga)) {
+			return __TGA_LASTERR(tga);
+		}
+	} else if ((data->flags & TGA_IMAGE_DATA) && tga->hdr.id_len) {
+		/* the header announces an id, keep the data where it says */
+		static const tbyte no_id[255];
+		TGAWrite(tga, no_id, tga->hdr.id_len, 1);
+		if (!__TGA_SUCCEEDED(tga)) {
+			return __TGA_LASTERR(tga);
+		}
+	}
+
+	if (data->flags & TGA_IMAGE_DATA) {
+		TGAWriteColorMap(tga, data);
+		if (!__TGA_SUCCEEDED(tga)) {
+			return __TGA_LASTERR(tga);
+		}
+	}
+
+	tga->row = 0;
+	return TGA_OK;
+}
+
+
+int
+TGAWriteScanline(TGA	 *tga,
+		 tbyte	 *line,
+		 tuint32  flags)
+{
+	if (!tga) return TGA_ERROR;
+	if (!line || tga->row >= tga->hdr.height) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+
+	const TGAKernel *k = __TGAKernel(tga, flags);
+	if (!k) {
+		TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+		return __TGA_LASTERR(tga);
+	}
+
+	size_t sln_size = TGA_SCANLINE_SIZE(tga);
+	if (k->swap) {
+		k->swap(line, line, tga->hdr.width);
+		TGA_TRACE_EVENT(CONVERT, tga, 1, tga->row, 1, sln_size);
+	}
+
+	const tuint64 start = tga->off;
+	if (TGA_IMGTYPE_IS_ENCODED(tga)) {
+		k->write_rle(tga, line);
+	} else {
+		TGAWrite(tga, line, sln_size, 1);
+	}
+	if (!__TGA_SUCCEEDED(tga)) {
+		return __TGA_LASTERR(tga);
+	}
+	TGA_TRACE_EVENT(ROWS, tga, 1, tga->row, 1, tga->off - start);
+
+	++tga->row;
+	return TGA_OK;
+}
+
+
+int
+TGAWriteEnd(TGA *tga)
+{
+	if (!tga) return TGA_ERROR;
+
+	if (TGA_IMGTYPE_AVAILABLE(tga) && tga->row != tga->hdr.height) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+
+	if (fflush(tga->fd)) {
+		TGA_ERROR(tga, TGA_WRITE_FAIL);
+		return __TGA_LASTERR(tga);
+	}
+
+	return TGA_OK;
+}
+
+
+static void
+put_le32(tbyte *buf,
+	 tlong	val)
+{
+	buf[0] = val & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	buf[2] = (val >> 16) & 0xff;
+	buf[3] = (val >> 24) & 0xff;
+}
+
+
+/* Build a postage stamp of at most TGA_STAMP_MAX pixels per side from the
+ * scanlines just written, which are in file order by now. Truecolor and
+ * grayscale pixels are box-filtered, anything else is point-sampled so the
+ * stamp keeps the pixel format of the image. */
+static tbyte *
+make_postage_stamp(TGA     *tga,
+		   TGAData *data,
+		   size_t  *size)
+{
+	const size_t width = tga->hdr.width;
+	const size_t height = tga->hdr.height;
+	const size_t sample_bytes = TGA_PIXEL_SIZE(tga->hdr.depth);
+	const size_t sln_size = TGA_SCANLINE_SIZE(tga);
+	const int average = !TGA_IMGTYPE_IS_MAPPED(tga) &&
+		(tga->hdr.depth == 8 || TGA_CAN_SWAP(tga->hdr.depth));
+
+	size_t scale = ((width > height ? width : height) + TGA_STAMP_MAX - 1) /
+		TGA_STAMP_MAX;
+	if (scale == 0) scale = 1;
+	const size_t stamp_w = TGA_SCALED_DIM(width, scale);
+	const size_t stamp_h = TGA_SCALED_DIM(height, scale);
+	const size_t out_size = stamp_w * sample_bytes;
+
+	*size = 2 + out_size * stamp_h;
+	tbyte *stamp = (tbyte*) malloc(*size);
+	tuint32 *acc = (tuint32*) calloc(out_size, sizeof(tuint32));
+	if (!stamp || !acc) {
+		free(stamp);
+		free(acc);
+		return NULL;
+	}
+
+	stamp[0] = stamp_w;
+	stamp[1] = stamp_h;
+	tbyte *out = stamp + 2;
+	for (size_t y = 0; y < height; ++y) {
+		const tbyte *row = data->img_data + y * sln_size;
+		const size_t band_y = y % scale;
+		if (average) {
+			__TGAScaleAccumulate(acc, row, width,
+				sample_bytes, sample_bytes, scale);
+		} else if (band_y == 0) {
+			for (size_t x = 0; x < stamp_w; ++x) {
+				memcpy(out + x * sample_bytes,
+					row + x * scale * sample_bytes, sample_bytes);
+			}
+		}
+
+		if (band_y == scale - 1 || y + 1 == height) {
+			if (average) {
+				__TGAScaleAverage(acc, out, width,
+					sample_bytes, scale, band_y + 1);
+			}
+			out += out_size;
+		}
+	}
+
+	free(acc);
+	return stamp;
+}
+
+
+/* Postage stamp, extension area and footer for image data ending at off.
+ * Returns the stamp, or NULL if the image gets none or on TGA_OOM. */
+tbyte *
+__TGAMakeExtension(TGA	   *tga,
+		   TGAData *data,
+		   tuint64  off,
+		   size_t  *stamp_size,
+		   tbyte   *ext,
+		   tbyte   *footer)
+{
+	if (!TGA_IMGTYPE_AVAILABLE(tga) || !data->img_data ||
+	    tga->hdr.width == 0 || tga->hdr.height == 0) {
+		return NULL;
+	}
+	/* the footer can only address the first 4 GB of the file */
+	if (off + TGA_STAMP_MAX * TGA_STAMP_MAX * 4 + TGA_EXT_SIZE >
+	    0xFFFFFFFFu) {
+		return NULL;
+	}
+
+	tbyte *stamp = make_postage_stamp(tga, data, stamp_size);
+	if (!stamp) {
+		TGA_ERROR(tga, TGA_OOM);
+		return NULL;
+	}
+
+	bzero(ext, TGA_EXT_SIZE);
+	ext[0] = LSB_SH(TGA_EXT_SIZE);
+	ext[1] = MSB_SH(TGA_EXT_SIZE);
+	put_le32(ext + TGA_EXT_STAMP_OFF, off);
+	ext[TGA_EXT_ATTR_OFF] = tga->hdr.alpha ? 3 : 0;
+
+	bzero(footer, TGA_FOOTER_SIZE);
+	put_le32(footer, off + *stamp_size);
+	memcpy(footer + 8, TGA_SIGNATURE, sizeof(TGA_SIGNATURE));
+	return stamp;
+}
+
+
+/* postage stamp, extension area and footer, appended to the image data */
+static int
+write_extension(TGA     *tga,
+		TGAData *data)
+{
+	size_t stamp_size;
+	tbyte ext[TGA_EXT_SIZE];
+	tbyte footer[TGA_FOOTER_SIZE];
+	tbyte *stamp = __TGAMakeExtension(tga, data, tga->off, &stamp_size,
+		ext, footer);
+	if (!stamp) {
+		return __TGA_LASTERR(tga);
+	}
+
+	TGAWrite(tga, stamp, stamp_size, 1);
+	free(stamp);
+	TGAWrite(tga, ext, TGA_EXT_SIZE, 1);
+	TGAWrite(tga, footer, TGA_FOOTER_SIZE, 1);
+	return __TGA_LASTERR(tga);
+}
@@ -0,0 +1,248 @@
+/*
+ *  tgawritev.c - Whole image writer with a single vectored write
+ *
+ *  This file is part of the TGA library (libtga).
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* pwritev, posix_fallocate */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <tga.h>
+#include "tga_private.h"
+
+/* header, id, color map, pixels, stamp, extension, footer */
+#define MAX_IOV 7
+
+
+/* Submit iov at off, or at the current position when off is -1. Loops
+ * over short writes, which only happen for huge images or on signals. */
+static int
+submit(int	     fd,
+       struct iovec *iov,
+       int	     iovcnt,
+       off_t	     off)
+{
+	while (iovcnt > 0) {
+		ssize_t n = off < 0 ? writev(fd, iov, iovcnt) :
+			pwritev(fd, iov, iovcnt, off);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return TGA_WRITE_FAIL;
+		}
+		if (off >= 0) off += n;
+		for (; iovcnt > 0 && (size_t) n >= iov->iov_len; ++iov, --iovcnt) {
+			n -= iov->iov_len;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (tbyte*) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return TGA_OK;
+}
+
+
+/* The RLE packets of every scanline, back to back. */
+static tbyte *
+encode_image(TGA	     *tga,
+	     const TGAKernel *k,
+	     const tbyte     *img,
+	     size_t	     *size)
+{
+	const size_t width = tga->hdr.width;
+	const size_t sln_size = TGA_SCANLINE_SIZE(tga);
+	const tuint64 cap = (tuint64) tga->hdr.height * width *
+		(k->sample_bytes + 1);
+	if (!TGA_SIZE_OK(cap)) {
+		return NULL;
+	}
+
+	void *tmp = __TGARLETmp(tga);
+	tbyte *buf = (tbyte*) malloc(cap ? cap : 1);
+	if (!tmp || !buf) {
+		free(buf);
+		return NULL;
+	}
+	size_t fill = 0;
+	for (size_t y = 0; y < tga->hdr.height; ++y) {
+		fill += k->encode_rle(img + y * sln_size, width, buf + fill, tmp);
+	}
+	*size = fill;
+	return buf;
+}
+
+
+/* TGAWriteImage with TGA_WRITEV: produces the same bytes as the regular
+ * writer, but lays them out in memory and hands them to the kernel at once. */
+int
+__TGAWriteImageV(TGA	 *tga,
+		 TGAData *data)
+{
+	static const tbyte no_id[255];
+
+	const int pixels = (data->flags & TGA_IMAGE_DATA) &&
+		TGA_IMGTYPE_AVAILABLE(tga);
+	if ((pixels && !data->img_data) ||
+	    ((data->flags & TGA_IMAGE_ID) && tga->hdr.id_len && !data->img_id)) {
+		TGA_ERROR(tga, TGA_ERROR);
+		return __TGA_LASTERR(tga);
+	}
+	if (!tga->seekable && tga->off != 0) {
+		TGA_ERROR(tga, TGA_SEEK_FAIL);
+		return __TGA_LASTERR(tga);
+	}
+
+	struct iovec iov[MAX_IOV];
+	int iovcnt = 1;
+	tbyte header[TGA_HEADER_SIZE];
+	tbyte *rle = NULL;
+	tbyte *stamp = NULL;
+	tbyte ext[TGA_EXT_SIZE];
+	tbyte footer[TGA_FOOTER_SIZE];
+	tuint64 total = TGA_HEADER_SIZE;
+	tuint64 pixel_bytes = 0;
+
+#define ADD_IOV(ptr, len) \
+	do { \
+		iov[iovcnt].iov_base = (void*) (ptr); \
+		iov[iovcnt].iov_len = (len); \
+		total += (len); \
+		++iovcnt; \
+	} while (0)
+
+	if ((data->flags & TGA_IMAGE_ID) && tga->hdr.id_len) {
+		ADD_IOV(data->img_id, tga->hdr.id_len);
+	} else if ((data->flags & TGA_IMAGE_DATA) && tga->hdr.id_len) {
+		ADD_IOV(no_id, tga->hdr.id_len);
+	}
+
+	if (data->flags & TGA_IMAGE_DATA) {
+		size_t n = TGA_CMAP_SIZE(tga);
+		if (n == 0) {
+			data->flags &= ~TGA_COLOR_MAP;
+		} else if (!data->cmap) {
+			TGA_ERROR(tga, TGA_ERROR);
+			return __TGA_LASTERR(tga);
+		} else {
+			data->flags |= TGA_COLOR_MAP;
+			if (TGA_CAN_SWAP(tga->hdr.map_entry) &&
+			    (data->flags & TGA_RGB)) {
+				__TGAbgr2rgb(data->cmap, n, tga->hdr.map_entry / 8);
+				data->flags &= ~TGA_RGB;
+			}
+			ADD_IOV(data->cmap, n);
+		}
+	}
+
+	if (pixels) {
+		const TGAKernel *k = __TGAKernel(tga, data->flags);
+		if (!k) {
+			TGA_ERROR(tga, TGA_UNKNOWN_SUB_FORMAT);
+			return __TGA_LASTERR(tga);
+		}
+		if (k->swap) {
+			k->swap(data->img_data, data->img_data,
+				(size_t) tga->hdr.width * tga->hdr.height);
+			TGA_TRACE_EVENT(CONVERT, tga, 1, 0, tga->hdr.height,
+				TGA_IMG_DATA_SIZE(tga));
+		}
+
+		if (data->flags & TGA_RLE_ENCODE) {
+			size_t rle_size;
+			rle = encode_image(tga, k, data->img_data, &rle_size);
+			if (!rle) {
+				TGA_ERROR(tga, TGA_OOM);
+				return __TGA_LASTERR(tga);
+			}
+			tga->hdr.img_t |= 0x8;
+			ADD_IOV(rle, rle_size);
+			pixel_bytes = rle_size;
+		} else {
+			tga->hdr.img_t &= ~0x8;
+			ADD_IOV(data->img_data, TGA_IMG_DATA_SIZE(tga));
+			pixel_bytes = TGA_IMG_DATA_SIZE(tga);
+		}
+
+		if (data->flags & TGA_POSTAGE_STAMP) {
+			size_t stamp_size;
+			stamp = __TGAMakeExtension(tga, data, total, &stamp_size,
+				ext, footer);
+			if (!__TGA_SUCCEEDED(tga)) {
+				free(rle);
+				return __TGA_LASTERR(tga);
+			}
+			if (stamp) {
+				ADD_IOV(stamp, stamp_size);
+				ADD_IOV(ext, TGA_EXT_SIZE);
+				ADD_IOV(footer, TGA_FOOTER_SIZE);
+			}
+		}
+	}
+#undef ADD_IOV
+
+	/* the header goes last, it carries the final image type */
+	__TGAPackHeader(tga, header);
+	iov[0].iov_base = header;
+	iov[0].iov_len = TGA_HEADER_SIZE;
+
+	int fd = fileno(tga->fd);
+	int err = fflush(tga->fd) ? TGA_WRITE_FAIL : TGA_OK;
+	if (err == TGA_OK && tga->seekable && (data->flags & TGA_PREALLOCATE)) {
+		int r = posix_fallocate(fd, 0, (off_t) total);
+		/* not every file system can reserve space, that is fine */
+		if (r == ENOSPC || r == EFBIG) {
+			err = TGA_WRITE_FAIL;
+		}
+	}
+	if (err == TGA_OK) {
+		err = submit(fd, iov, iovcnt, tga->seekable ? 0 : -1);
+	}
+	free(rle);
+	free(stamp);
+	if (err != TGA_OK) {
+		TGA_ERROR(tga, err);
+		return __TGA_LASTERR(tga);
+	}
+
+	/* the sections went out together, report them in file order */
+	TGA_TRACE_EVENT(HEADER, tga, 1, 0, 0, TGA_HEADER_SIZE);
+	if (tga->hdr.id_len &&
+	    (data->flags & (TGA_IMAGE_ID | TGA_IMAGE_DATA))) {
+		TGA_TRACE_EVENT(IMAGE_ID, tga, 1, 0, 0, tga->hdr.id_len);
+	}
+	if ((data->flags & TGA_IMAGE_DATA) && TGA_CMAP_SIZE(tga) != 0) {
+		TGA_TRACE_EVENT(COLOR_MAP, tga, 1, 0, 0, TGA_CMAP_SIZE(tga));
+	}
+	if (pixels) {
+		TGA_TRACE_EVENT(ROWS, tga, 1, 0, tga->hdr.height, pixel_bytes);
+	}
+
+	if (tga->seekable) {
+		/* fd and FILE disagree about the position now */
+		__TGASeek(tga, total, SEEK_SET);
+	} else {
+		tga->off = total;
+	}
+	return __TGA_LASTERR(tga);
+}